@@ -8,6 +8,11 @@ namespace EstTools{
 
 const TString inputdir = "root://cmseos.fnal.gov//eos/uscms/store/user/mkilpatr/13TeV";
 const TString inputdir_local = "/uscms/home/mkilpatr/nobackup/CMSSW_10_2_22/src/PhysicsTools/NanoSUSYTools/python/processors";
+const TString inputcache = "/uscms_data/d3/mkilpatr/estcache"; // local copies of the EOS inputs (FileCache), see useInputCache()
+const TString skimdir = "/uscms_data/d3/mkilpatr/skims"; // slim skims (BaseEstimator::skimSamples), used by sigConfig(true)
+const TString yieldcache = "/uscms_data/d3/mkilpatr/yieldcache"; // memoized yield vectors (YieldCache), see useYieldCache()
+const TString sampleregistry = "sample_registry.json"; // cross sections per dataset (SampleRegistry)
+const TString sumwcache = yieldcache + "/sample_sumw.json"; // sums of generator weights of the input files
 const TString inputdir_2018 = "nanoaod_2018_diHiggs_21Dec21_LundVar/";
 //const TString inputdir_2018 = "";
 
@@ -210,11 +215,23 @@ map<TString, Category> lepCatMap(){
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
-BaseConfig sigConfig(){
+void useInputCache(bool checkRemote = true){
+  // read the EOS inputs from local copies in inputcache (FileCache), call it in the macro before the config
+  // is made; needs space for the inputs on the local disk, so it is not part of the configs
+  FileCache::instance().enable(inputcache, 200LL*1024*1024*1024, checkRemote);
+}
+
+void useYieldCache(){
+  // keep the memoized yields on disk in yieldcache, shared by later runs (in memory only otherwise)
+  YieldCache::instance().enable(yieldcache);
+}
+
+BaseConfig sigConfig(bool useSkims = false){
   BaseConfig     config;
 
   //config.inputdir = inputdir_local;
   config.inputdir = inputdir;
+  if (useSkims) config.skimdir = skimdir; // only with skims made by makeSkims() for the current baseline
   config.outputdir = outputdir+"/sig";
   config.header = "#sqrt{s} = 13 TeV, "+lumistr+" fb^{-1}";
 
@@ -236,6 +253,37 @@ BaseConfig sigConfig(){
 }
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
+// per-event weight of the per-job files, normalized at runtime by the cross sections in sampleregistry
+// and the sum of genWeight of the files (SampleRegistry)
+const TString unmerged_wgtvar = lumistr+"*1000*genWeight";
+
+BaseConfig sigConfigUnmerged(){
+  // same as sigConfig, but on the per-job files sorted into directories by hadd_samples_dihiggs.sh (before hadd'ing)
+  BaseConfig     config;
+
+  config.inputdir = inputdir;
+  config.outputdir = outputdir+"/sig";
+  config.header = "#sqrt{s} = 13 TeV, "+lumistr+" fb^{-1}";
+  SampleRegistry registry(sampleregistry, sumwcache);
+
+  //signal
+  registry.addSample(config, "ggHHto2b2tau",     "gg#rightarrowHH#rightarrowbb#tau#tau",   inputdir_2018+"ggHHto2b2tau/*GluGluToHHTo2B2Tau_node_SM_*.root",  unmerged_wgtvar,  datasel);
+  registry.addSample(config, "ggHto2tau",        "gg#rightarrowH#rightarrow#tau#tau",      inputdir_2018+"ggHto2tau",  unmerged_wgtvar,  datasel);
+  registry.addSample(config, "vbfHto2tau",       "VBF#rightarrowH#rightarrow#tau#tau",     inputdir_2018+"vbfHto2tau",  unmerged_wgtvar,  datasel);
+  //background
+  registry.addSample(config, "qcd",              "QCD",                                    inputdir_2018+"qcd",  unmerged_wgtvar,  datasel);
+  registry.addSample(config, "diboson",          "VV",                                     inputdir_2018+"diboson/ww,"+inputdir_2018+"diboson/wz,"+inputdir_2018+"diboson/zz",  unmerged_wgtvar,  datasel);
+  registry.addSample(config, "wjets",            "W+jets",                                 inputdir_2018+"wjets",  unmerged_wgtvar,  datasel);
+  registry.addSample(config, "dyll",             "DY+jets",                                inputdir_2018+"dyll",  unmerged_wgtvar,  datasel);
+
+  config.sel = baseline;
+  config.categories = srbins;
+  config.catMaps = srCatMap();
+
+  return config;
+}
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
 map<TString, BinInfo> varDict {
 	{"LundTau1M",		BinInfo("SVFit_LundTau1M",    "#tau_{1} ln(m)", 40, -2, 6)},
 	{"LundTau1KT",		BinInfo("SVFit_LundTau1KT",   "#tau_{1} ln(k_{T})", 40, -2, 6)},
@@ -359,5 +407,17 @@ map<TString, BinInfo> varDict {
 	{"met",         BinInfo("MET_pt", "#slash{E}_{T}", vector<int>{0, 50, 150, 250, 350, 450, 550, 650, 750, 1000}, "GeV")},
 };
 
+// Lund-plane variables of one object, filled together as one sparse histogram (HistBooker::bookSparse)
+// the lead SVFit channel is the last axis, so the channels are slices of the same histogram
+map<TString, vector<BinInfo>> lundPlaneDict = []{
+    map<TString, vector<BinInfo>> lmap;
+    for (TString obj : {"LundTau1", "LundTau2", "LundHiggs"}){
+      for (TString var : {"M", "KT", "Z", "Delta", "Kappa", "Psi"})
+        lmap[obj].push_back(varDict.at(obj + var));
+      lmap[obj].push_back(varDict.at("Lead_tauChannel"));
+    }
+    return lmap;
+}();
+
 }
 #endif /* ESTTOOLS_LMPARAMETERS_HH_ */
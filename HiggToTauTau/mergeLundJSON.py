@@ -4,6 +4,10 @@ import gzip
 import json
 import argparse
 import re
+import heapq
+import struct
+import math
+from multiprocessing import Pool
 
 parser = argparse.ArgumentParser(
         description='Produce or print limits based on existing datacards')
@@ -11,6 +15,16 @@ parser.add_argument("-d", "--dir", dest="baseDir", default='nanoAOD_diHiggs',
                          help="Base directory where files are located on EOS")
 parser.add_argument("-s", "--save", dest="saveDir", default='diHiggsJSON',
                          help="Directory where new merged files should be locally saved")
+parser.add_argument("-j", "--jobs", dest="jobs", type=int, default=8,
+                         help="Number of files processed in parallel")
+parser.add_argument("--fractions", dest="fractions", type=float, nargs=3, default=[0.6, 0.2, 0.2],
+                         metavar=('TRAIN', 'TEST', 'VALID'),
+                         help="Fraction of the events in train/test/valid (the rest is dropped)")
+parser.add_argument("--max-events", dest="maxEvents", type=int, nargs=3, default=[20000, 20000, 50000],
+                         metavar=('TRAIN', 'TEST', 'VALID'),
+                         help="Events per sample in train/test/valid, those with the smallest hash are kept (0: all)")
+parser.add_argument("--mix-size", dest="mixSize", type=int, default=100000,
+                         help="Number of events in the cross-section-weighted background mixture")
 args = parser.parse_args()
 
 eosDir = "/eos/uscms/store/user/mkilpatr/13TeV/" + args.baseDir + "/"
@@ -68,31 +82,40 @@ samples = {
 'QCD_HT2000toInf_TuneCP5_13TeV-madgraphMLM-pythia8': [20.35, 5445111, 30566]
 }
 
-nEvents = 20000
-MaxEvents = {
-  'train': nEvents,
-  'test': 2*nEvents,
-  'valid': 4.5*nEvents
-}
-totalEvents = 0
-totalXsec = 0.
-for key, listOfValues in samples.items():
-    if any(x in key for x in ['DYJetsToLL', 'WW', 'WZ', 'ZZ', 'WJets', 'QCD']):
-        totalXsec += listOfValues[0]
-        totalEvents += listOfValues[1]
-        totalEvents -= listOfValues[2]
-
-if not os.path.exists(args.saveDir):
-    os.makedirs(args.saveDir)
-    os.makedirs(args.saveDir+"/train/")
-    os.makedirs(args.saveDir+"/test/")
-    os.makedirs(args.saveDir+"/valid/")
-
-def write_json(fout, data):
-    fout.write((json.dumps(data, sort_keys=False)+'\n').encode('utf-8'))
-
-def writeTot_json(data):
-    ftot.write((json.dumps(data, sort_keys=False)+'\n').encode('utf-8'))
+splits = ['train', 'test', 'valid']
+quota = dict(zip(splits, args.maxEvents))
+for split in splits + ['mix']:
+    if not os.path.exists(args.saveDir + "/" + split + "/shards"):
+        os.makedirs(args.saveDir + "/" + split + "/shards")
+
+MASK64 = (1 << 64) - 1
+HASH_SEED = 14695981039346656037
+MIX_SEED = HASH_SEED ^ 0x6d6978 # independent of the split
+
+def event_uniform(run, lumi, event, seed=HASH_SEED):
+    # same as LundSplit::uniform (utils/LundExporter.hh): FNV-1a of the three ids as little-endian uint64,
+    # then the splitmix64 finalizer; in [0, 1)
+    h = seed
+    for b in struct.pack('<QQQ', run & MASK64, lumi & MASK64, event & MASK64):
+        h = ((h ^ b) * 1099511628211) & MASK64
+    h ^= h >> 30; h = (h * 0xbf58476d1ce4e5b9) & MASK64
+    h ^= h >> 27; h = (h * 0x94d049bb133111eb) & MASK64
+    h ^= h >> 31
+    return (h >> 11) / 9007199254740992.
+
+def hash_string(s, h=HASH_SEED):
+    # same as hashString (utils/MiniTools.hh): FNV-1a of the length (as a little-endian uint64) and the bytes
+    for b in struct.pack('<Q', len(s)) + s.encode():
+        h = ((h ^ b) * 1099511628211) & MASK64
+    return h
+
+def split_of(u):
+    # the split of an event only depends on its ids, not on file order or on which worker reads it
+    edge = 0.
+    for split, frac in zip(splits, args.fractions):
+        edge += frac
+        if u < edge: return split
+    return None
 
 def gz_size(fname):
     with gzip.open(fname, 'rb') as f:
@@ -104,46 +127,121 @@ def fileName(fname):
     n = fname.replace(p.group(), '').replace(g + "_", '')
     return n
 
-def open_json(ftrain, ftest, fvalid, jsonfilename, fname, maxEvents):
-    if gz_size(jsonfilename):
-        eventList = samples[fileName(fname)]
-        eventFrac, xsecFrac = float((eventList[1] - eventList[2])/totalEvents), float(eventList[0]/totalXsec)
-        with gzip.open(jsonfilename,'r') as fin:        
-            for line in fin:        
-                if line == "\n": continue
-                if maxEvents < MaxEvents["train"]: write_json(ftrain, json.loads(line))
-                elif maxEvents >= MaxEvents["train"] and maxEvents < MaxEvents["test"]: write_json(ftest, json.loads(line))
-                elif maxEvents >= MaxEvents["test"] and maxEvents < MaxEvents["valid"]: write_json(fvalid, json.loads(line))
-                else: break
-
-                if any(x in jsonfilename for x in ['dyll', 'diboson', 'wjets', 'qcd']):
-                    if maxEvents/totalEvents < eventFrac and maxEvents/totalEvents < xsecFrac:
-                        writeTot_json(json.loads(line))
-                maxEvents+=1
-    return maxEvents, fileName(fname)
+def mix_weight(name):
+    # cross section per effective event (signed events sum to nEvents - 2*nNegative), as SampleNorm::eventWeight (utils/Config.h)
+    xsec, nEvents, nNegative = samples[name]
+    nEff = nEvents - 2*nNegative
+    return float(xsec)/nEff if nEff > 0 else 0.
+
+def read_records(jsonfilename):
+    # (line, (run, lumi, event)) of every record; the records must carry the event ids, as written by
+    # exportLundSamples (utils/LundExporter.hh), files from older exports have to be remade
+    with gzip.open(jsonfilename, 'rb') as fin:
+        for line in fin:
+            if not line.strip(): continue
+            if not line.endswith(b'\n'): line += b'\n'
+            rec = json.loads(line)
+            try:
+                ids = int(rec['run']), int(rec['luminosityBlock']), int(rec['event'])
+            except KeyError:
+                raise RuntimeError(jsonfilename + ": records without run/luminosityBlock/event, re-export them with exportLundSamples")
+            yield line, ids
+
+def mix_key(name, ids, w):
+    # weighted reservoir (A-ES): key u^(1/w), the mixSize largest keys over all files are the mixture
+    # (same keys as WeightedReservoir/LundMixSampler in utils/LundExporter.hh, with the dataset as the sample
+    # name: MC datasets reuse (run, lumi, event))
+    u = event_uniform(*ids, seed=hash_string(name, MIX_SEED))
+    return math.log(u)/w if u > 0 else float('-inf')
+
+def push_bounded(heap, n, value):
+    # min-heap of the n largest values seen so far
+    if len(heap) < n: heapq.heappush(heap, value)
+    elif value > heap[0]: heapq.heapreplace(heap, value)
+
+def scan_file(task):
+    # pass 1, hashes only: per split the quota smallest hashes of this file (as negatives), and its mixSize largest
+    # mix keys; memory is bounded by the quotas, whatever the size of the file
+    jsonfilename, fname, shard, isBkg = task
+    smallest = dict((split, []) for split in splits)
+    keys = []
+    if not gz_size(jsonfilename): return smallest, keys
+    name = fileName(fname)
+    w = mix_weight(name) if isBkg else 0.
+    for line, ids in read_records(jsonfilename):
+        u = event_uniform(*ids)
+        split = split_of(u)
+        if split and quota[split] > 0: push_bounded(smallest[split], quota[split], -u)
+        if w > 0 and args.mixSize > 0: push_bounded(keys, args.mixSize, mix_key(name, ids, w))
+    return smallest, keys
+
+def write_file(task):
+    # pass 2: one shard per split with the events below the hash threshold of their sample, and one with the
+    # events of the background mixture; lines are copied as they are
+    (jsonfilename, fname, shard, isBkg), thresholds, mixThreshold = task
+    if not gz_size(jsonfilename): return
+    name = fileName(fname)
+    w = mix_weight(name) if isBkg else 0.
+    fout = dict((split, gzip.open(args.saveDir + "/" + split + "/shards/" + shard, 'wb')) for split in splits + ['mix'])
+    for line, ids in read_records(jsonfilename):
+        u = event_uniform(*ids)
+        split = split_of(u)
+        if split and u <= thresholds[split]: fout[split].write(line)
+        if w > 0 and args.mixSize > 0 and mix_key(name, ids, w) >= mixThreshold: fout['mix'].write(line)
+    for f in fout.values(): f.close()
+
+def merge_shards(split, outname, shards):
+    # concatenate the shards in sorted order: the output does not depend on the number of workers
+    with gzip.open(outname, 'wb') as fout:
+        for shard in sorted(shards):
+            if not os.path.exists(args.saveDir + "/" + split + "/shards/" + shard): continue # empty input
+            with gzip.open(args.saveDir + "/" + split + "/shards/" + shard, 'rb') as fin:
+                for line in fin: fout.write(line)
+            os.remove(args.saveDir + "/" + split + "/shards/" + shard)
 
 for type in ['genHiggs']:
-    ftot = gzip.open(args.saveDir + "/" + type + "_bkg.json.gz", 'w')
-    for d in Dist:
+    tasks = []
+    shardsOf = {}
+    for d in sorted(Dist):
         if "json" in d: continue
         subDist = os.listdir(eosDir + d)
         onlyFiles = []
-        for sd in subDist:
+        for sd in sorted(subDist):
             if os.path.isdir(eosDir + d + "/" + sd): continue
             if "json" in sd:
                 if type in sd:
                     onlyFiles.append(sd)
                 elif type not in sd and 'gen' not in type:
                     onlyFiles.append(sd)
-    
-        ftrain = gzip.open(args.saveDir + "/train/" + type + "_" + d + ".json.gz", 'w')
-        ftest = gzip.open(args.saveDir + "/test/" + type + "_" + d + ".json.gz", 'w')
-        fvalid = gzip.open(args.saveDir + "/valid/" + type + "_" + d + ".json.gz", 'w')
         if(len(onlyFiles) > 0): print(eosDir + d + "/" + onlyFiles[0])
-        maxEvents = 0
-        name = ''
-        for idx, sd in enumerate(onlyFiles):
-            buff = fileName(sd)
-            if name != buff:
-                maxEvents = 0
-            maxEvents, name = open_json(ftrain, ftest, fvalid, eosDir + d + "/" + sd, sd, maxEvents)
+        isBkg = any(x in d for x in ['dyll', 'diboson', 'wjets', 'qcd'])
+        shardsOf[d] = []
+        for sd in onlyFiles:
+            shard = type + "_" + d + "_" + sd
+            shardsOf[d].append(shard)
+            tasks.append((eosDir + d + "/" + sd, sd, shard, isBkg))
+
+    # the per-sample caps keep the events with the smallest hashes of all files of the sample, and the
+    # mixture the mixSize largest keys of all background files: both independent of file order and --jobs
+    pool = Pool(args.jobs)
+    smallest = {}
+    mixKeys = []
+    for task, (fsmallest, keys) in zip(tasks, pool.imap(scan_file, tasks)):
+        s = smallest.setdefault(fileName(task[1]), dict((split, []) for split in splits))
+        for split in splits:
+            s[split] = heapq.nlargest(quota[split], s[split] + fsmallest[split])
+        mixKeys = heapq.nlargest(args.mixSize, mixKeys + keys)
+    thresholds = {}
+    for name, s in smallest.items():
+        thresholds[name] = dict((split, -s[split][-1] if quota[split] > 0 and len(s[split]) >= quota[split] else float('inf'))
+                                for split in splits)
+    mixThreshold = mixKeys[-1] if len(mixKeys) >= args.mixSize else float('-inf')
+    pool.map(write_file, [(task, thresholds[fileName(task[1])], mixThreshold) for task in tasks])
+    pool.close()
+    pool.join()
+
+    for d, shards in shardsOf.items():
+        for split in splits:
+            merge_shards(split, args.saveDir + "/" + split + "/" + type + "_" + d + ".json.gz", shards)
+
+    merge_shards('mix', args.saveDir + "/" + type + "_bkg.json.gz", [sh for d in sorted(shardsOf) for sh in shardsOf[d]])
@@ -0,0 +1,222 @@
+#ifndef ESTTOOLS_CATEGORYMASKER_HH_
+#define ESTTOOLS_CATEGORYMASKER_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <iomanip>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include "TFile.h"
+#include "TNamed.h"
+
+#include "HistBooker.hh"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class CategoryMasker : public HistBooker {
+  // Evaluate the cuts of all categories once per event into a bitmask (bit i = category i),
+  // in one pass over the tree. Derived classes consume the mask per entry in processMask().
+  // By default it accumulates the category overlap matrix (weighted and unweighted).
+
+public:
+  CategoryMasker(TTree *intree, const std::vector<Category>& cats, TString wgtvar = "1", TString presel = "") :
+    HistBooker(intree, "1", presel), cats_(cats), nwords_((cats.size()+63)/64) {
+    for (const auto &cat : cats_) icats_.push_back(getFormula(cat.cut));
+    iwgt_ = getFormula(wgtvar);
+    mask_.assign(nwords_, 0);
+    counts_.assign(cats_.size(), std::vector<Long64_t>(cats_.size(), 0));
+    sumw_.assign(cats_.size(), std::vector<double>(cats_.size(), 0));
+    sumw2_.assign(cats_.size(), std::vector<double>(cats_.size(), 0));
+  }
+
+  virtual ~CategoryMasker() {}
+
+  const std::vector<Category>& categories() const { return cats_; }
+
+  Long64_t count(unsigned i, unsigned j) const { return counts_.at(i).at(j); }
+  Quantity yield(unsigned i, unsigned j) const { return Quantity(sumw_.at(i).at(j), std::sqrt(sumw2_.at(i).at(j))); }
+
+  std::vector<std::pair<unsigned, unsigned>> overlaps() const {
+    // all pairs (i<j) of categories sharing at least one event
+    std::vector<std::pair<unsigned, unsigned>> pairs;
+    for (unsigned i=0; i<cats_.size(); ++i)
+      for (unsigned j=i+1; j<cats_.size(); ++j)
+        if (counts_[i][j]) pairs.emplace_back(i, j);
+    return pairs;
+  }
+
+  void printOverlaps() const {
+    // diagonal: events in each category; off-diagonal: events in both
+    cout << "Category overlap matrix (unweighted | weighted)" << endl;
+    for (unsigned i=0; i<cats_.size(); ++i){
+      cout << setw(30) << cats_[i].name;
+      for (unsigned j=0; j<cats_.size(); ++j) cout << "\t" << setw(8) << counts_[i][j];
+      cout << "\t|";
+      for (unsigned j=0; j<cats_.size(); ++j) cout << "\t" << setw(10) << std::defaultfloat << setprecision(4) << sumw_[i][j];
+      cout << endl;
+    }
+    auto pairs = overlaps();
+    cout << pairs.size() << " overlapping category pairs" << endl;
+    for (const auto &p : pairs){
+      cout << "  " << cats_[p.first].name << " && " << cats_[p.second].name << ": " << counts_[p.first][p.second]
+           << " events, " << fixed << setprecision(2) << yield(p.first, p.second) << " weighted" << endl;
+    }
+  }
+
+protected:
+  virtual void processEntry(Long64_t entry, double wgt) override {
+    std::fill(mask_.begin(), mask_.end(), 0);
+    for (unsigned i=0; i<icats_.size(); ++i){
+      if (eval(icats_[i]) != 0) mask_[i/64] |= (uint64_t(1) << (i%64));
+    }
+    processMask(entry, mask_, eval(iwgt_) * wgt); // *wgt*: the per-tree weight (HistBooker::setTreeWeights)
+  }
+
+  virtual void processMask(Long64_t /*entry*/, const std::vector<uint64_t>& mask, double wgt){
+    // only the set bits are visited, so the cost scales with the number of categories an event is in
+    setbits_.clear();
+    for (unsigned w=0; w<mask.size(); ++w){
+      uint64_t bits = mask[w];
+      while (bits){
+        int b = __builtin_ctzll(bits);
+        setbits_.push_back(w*64 + b);
+        bits &= bits-1;
+      }
+    }
+    for (auto i : setbits_){
+      for (auto j : setbits_){
+        ++counts_[i][j];
+        sumw_[i][j] += wgt;
+        sumw2_[i][j] += wgt*wgt;
+      }
+    }
+  }
+
+  std::vector<Category> cats_;
+  unsigned nwords_;
+  std::vector<int> icats_;
+  int iwgt_;
+  std::vector<uint64_t> mask_;
+  std::vector<unsigned> setbits_;
+
+  std::vector<std::vector<Long64_t>> counts_;
+  std::vector<std::vector<double>>   sumw_;
+  std::vector<std::vector<double>>   sumw2_;
+
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class CategoryIndexWriter : public CategoryMasker {
+  // Write the category membership of every entry of *intree* as a friend tree (one row per entry), so that
+  // later yields/plots/tables use integer lookups instead of re-evaluating the category cuts:
+  //  * CatIndex.catBits[n]: bit (i%32) of word i/32 set if the entry passes the cut of category i
+  //                         (32-bit words, exact in TTreeFormula's double arithmetic)
+  //  * CatIndex.binIndex:   index in the yields vector (categories in order, then the bins of cat.bin) of the
+  //                         bin of the first matching category, -1 if none; the bin is found from cat.bin.var
+  //                         and cat.bin.plotbins as getYieldVector does (overflow in the last bin, underflow
+  //                         dropped), for a bin variable with a single value per event
+  // The hash of the category definitions and of the input tree is stored with it (see categoryIndexHash).
+
+public:
+  CategoryIndexWriter(TTree *intree, const std::vector<Category>& cats, TString outfile, const std::string &hash) :
+    CategoryMasker(intree, cats), outfile_(outfile), hash_(hash) {
+    int offset = 0;
+    for (const auto &cat : cats_){
+      ivars_.push_back(getFormula(cat.bin.var));
+      offsets_.push_back(offset);
+      offset += cat.bin.nbins;
+    }
+    nbitwords_ = (cats_.size()+31)/32;
+    bits_.assign(nbitwords_, 0);
+
+    TDirectory::TContext ctxt;
+    fout_.reset(TFile::Open(outfile_, "RECREATE"));
+    if (!fout_ || fout_->IsZombie())
+      throw std::invalid_argument(("CategoryIndexWriter: cannot create " + outfile_).Data());
+    fout_->cd();
+    outtree_ = new TTree(TREE_NAME, "category index of " + TString(intree->GetTitle()));
+    outtree_->Branch("catBits", bits_.data(), TString::Format("catBits[%u]/i", nbitwords_));
+    outtree_->Branch("binIndex", &binIndex_, "binIndex/I");
+  }
+
+  virtual ~CategoryIndexWriter() {}
+
+  Long64_t write(){
+    // fill the friend tree (one pass over the input tree) and close the file
+    Long64_t n = fill();
+    TDirectory::TContext ctxt;
+    fout_->cd();
+    outtree_->Write();
+    TNamed(HASH_NAME, hash_.c_str()).Write();
+    fout_->Close();
+    fout_.reset();
+    return n;
+  }
+
+  static std::string categoryIndexHash(const TTree *intree, TString filepath, const std::vector<Category>& cats){
+    // changes if any category/bin cut changes, or if the input tree is a different one
+    uint64_t h = hashString(filepath);
+    h = hashNumber(intree->GetEntries(), h);
+    for (const auto &cat : cats){
+      h = hashString(cat.name, h);
+      h = hashString(cat.cut, h);
+      h = hashString(cat.bin.var, h);
+      for (auto edge : cat.bin.plotbins) h = hashNumber(edge, h);
+    }
+    return hashToString(h);
+  }
+
+  static bool isUpToDate(TString friendfile, const std::string &hash){
+    if (gSystem->AccessPathName(friendfile)) return false;
+    TDirectory::TContext ctxt;
+    std::unique_ptr<TFile> f(TFile::Open(friendfile));
+    if (!f || f->IsZombie()) return false;
+    auto *named = dynamic_cast<TNamed*>(f->Get(HASH_NAME));
+    return named && hash == named->GetTitle();
+  }
+
+  static int findBin(const BinInfo &bin, double x){
+    // bin of *x* as filled by getYieldVector: -1 below the first edge, the last bin at or above the last edge (or NaN)
+    const auto &edges = bin.plotbins;
+    if (x < edges.front()) return -1;
+    if (!(x < edges.back())) return bin.nbins-1;
+    return std::upper_bound(edges.begin(), edges.end(), x) - edges.begin() - 1;
+  }
+
+  static constexpr const char* TREE_NAME = "CatIndex";
+  static constexpr const char* HASH_NAME = "CatIndexHash";
+
+protected:
+  virtual void processMask(Long64_t entry, const std::vector<uint64_t>& mask, double wgt) override {
+    CategoryMasker::processMask(entry, mask, wgt);
+    std::fill(bits_.begin(), bits_.end(), 0);
+    binIndex_ = -1;
+    for (auto i : setbits_){
+      bits_[i/32] |= (1u << (i%32));
+      if (binIndex_ >= 0) continue;
+      int ib = findBin(cats_[i].bin, eval(ivars_[i]));
+      if (ib >= 0) binIndex_ = offsets_[i] + ib;
+    }
+    outtree_->Fill();
+  }
+
+  TString outfile_;
+  std::string hash_;
+  std::unique_ptr<TFile> fout_;
+  TTree *outtree_ = nullptr;
+
+  std::vector<int> ivars_;
+  std::vector<int> offsets_;
+  unsigned nbitwords_;
+  std::vector<UInt_t> bits_;
+  Int_t binIndex_ = -1;
+
+};
+
+}
+#endif /*ESTTOOLS_CATEGORYMASKER_HH_*/
@@ -0,0 +1,297 @@
+#ifndef ESTTOOLS_COLUMNSTORE_HH_
+#define ESTTOOLS_COLUMNSTORE_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <stdexcept>
+#include <memory>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "EstHelper.hh"
+
+using namespace std;
+using json = nlohmann::json;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Column store: a directory with one flat file per *expression* (evaluated once from the tree) and a schema.json.
+//  * <i>.bin: the values of column i as doubles, all instances of all entries back to back
+//  * <i>.cnt: number of instances per entry (uint32), only written if it is not always 1
+// The files are memory-mapped read-only, so kernels run on the mapped arrays and concurrent jobs on a node
+// share the OS page cache. Selections are stored per top-level "&&" term (splitConjuncts), so any selection
+// built from stored terms (e.g. config.sel && cat.cut && sample.sel) can be evaluated.
+
+vector<TString> splitConjuncts(TString sel){
+  // top-level "&&" terms of *sel*, fully parenthesized terms are split further: "(a && b) && c" -> {a, b, c}
+  vector<TString> terms;
+  sel = sel.Strip(TString::kBoth);
+  if (sel.IsWhitespace()) return terms;
+  while (sel.BeginsWith("(") && sel.EndsWith(")")){
+    // strip the outer parentheses only if they enclose everything
+    int depth = 0;
+    bool encloses = true;
+    for (int i=0; i<sel.Length()-1; ++i){
+      if (sel[i]=='(') ++depth;
+      else if (sel[i]==')') --depth;
+      if (depth==0){ encloses = false; break; }
+    }
+    if (!encloses) break;
+    sel = TString(sel(1, sel.Length()-2)).Strip(TString::kBoth);
+  }
+  int depth = 0, last = 0;
+  vector<TString> parts;
+  for (int i=0; i<sel.Length(); ++i){
+    char c = sel[i];
+    if (c=='(' || c=='[') ++depth;
+    else if (c==')' || c==']') --depth;
+    else if (depth==0 && c=='&' && i+1<sel.Length() && sel[i+1]=='&'){
+      parts.push_back(sel(last, i-last));
+      last = i+2;
+      ++i;
+    }
+  }
+  parts.push_back(sel(last, sel.Length()-last));
+  if (parts.size()==1){
+    terms.push_back(sel);
+    return terms;
+  }
+  for (auto &p : parts){
+    auto sub = splitConjuncts(p);
+    terms.insert(terms.end(), sub.begin(), sub.end());
+  }
+  return terms;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+Long64_t writeColumnStore(TTree *intree, TString outdir, const vector<TString> &exprs, TString presel = ""){
+  // evaluate every expression for the entries passing *presel* and write them as columns to *outdir*
+  // (selections in *exprs* are split into their "&&" terms, each term becomes a column)
+  assert(intree);
+  std::set<TString> unique;
+  vector<TString> columns;
+  for (const auto &e : exprs){
+    for (const auto &t : splitConjuncts(e)){
+      if (unique.insert(t).second) columns.push_back(t);
+    }
+  }
+
+  gSystem->mkdir(outdir, true);
+  vector<std::unique_ptr<TTreeFormula>> formulas;
+  vector<std::unique_ptr<std::ofstream>> values, counts;
+  vector<bool> jagged(columns.size(), false);
+  for (unsigned i=0; i<columns.size(); ++i){
+    formulas.emplace_back(new TTreeFormula(TString::Format("col%u", i), columns[i], intree));
+    if (formulas.back()->GetNdim()==0)
+      throw std::invalid_argument(("writeColumnStore: cannot compile expression \"" + columns[i] + "\" on tree " + intree->GetTitle()).Data());
+    values.emplace_back(new std::ofstream(TString::Format("%s/%u.bin", outdir.Data(), i).Data(), std::ios::binary));
+    counts.emplace_back(new std::ofstream(TString::Format("%s/%u.cnt", outdir.Data(), i).Data(), std::ios::binary));
+  }
+  std::unique_ptr<TTreeFormula> fpre(presel.IsWhitespace() ? nullptr : new TTreeFormula("colpresel", presel, intree));
+
+  Long64_t nrows = 0;
+  int treenumber = -1;
+  for (Long64_t i=0; i<intree->GetEntries(); ++i){
+    if (intree->LoadTree(i) < 0)
+      throw std::runtime_error(TString::Format("writeColumnStore: cannot load entry %lld of %s", i, intree->GetTitle()).Data());
+    if (intree->GetTreeNumber() != treenumber){
+      treenumber = intree->GetTreeNumber();
+      for (auto &f : formulas) f->UpdateFormulaLeaves();
+      if (fpre) fpre->UpdateFormulaLeaves();
+    }
+    if (fpre && (fpre->GetNdata()==0 || fpre->EvalInstance(0)==0)) continue;
+    for (unsigned c=0; c<columns.size(); ++c){
+      auto &f = formulas[c];
+      uint32_t n = f->GetNdata();
+      if (n!=1) jagged[c] = true;
+      for (uint32_t k=0; k<n; ++k){
+        double v = f->EvalInstance(k);
+        values[c]->write(reinterpret_cast<const char*>(&v), sizeof(v));
+      }
+      counts[c]->write(reinterpret_cast<const char*>(&n), sizeof(n));
+    }
+    ++nrows;
+  }
+
+  json schema;
+  schema["source"] = intree->GetTitle();
+  schema["nentries"] = nrows;
+  schema["presel"] = presel.Data();
+  for (unsigned c=0; c<columns.size(); ++c){
+    values[c]->close();
+    counts[c]->close();
+    if (!jagged[c]) gSystem->Unlink(TString::Format("%s/%u.cnt", outdir.Data(), c));
+    schema["columns"].push_back({{"expr", columns[c].Data()}, {"file", std::to_string(c)}, {"jagged", (bool)jagged[c]}});
+  }
+  std::ofstream fschema((outdir + "/schema.json").Data());
+  fschema << schema.dump(2) << endl;
+  cerr << "### Wrote " << columns.size() << " columns x " << nrows << " entries of " << intree->GetTitle() << " to " << outdir << endl;
+  return nrows;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class ColumnStore{
+  // read-only, memory-mapped view of a directory written by writeColumnStore
+
+public:
+  struct Column{
+    const double *values = nullptr;   // mapped values
+    size_t nvalues = 0;
+    vector<uint64_t> offsets;         // entry -> first value (only for jagged columns, size nentries+1)
+
+    uint32_t size(Long64_t entry) const { return offsets.empty() ? 1 : offsets[entry+1]-offsets[entry]; }
+    const double* at(Long64_t entry) const { return values + (offsets.empty() ? entry : offsets[entry]); }
+    double first(Long64_t entry) const { return size(entry) ? *at(entry) : 0; }
+  };
+
+  static std::shared_ptr<ColumnStore> open(TString dir){
+    // one mapping per directory and process
+    static std::mutex mutex;
+    static map<TString, std::weak_ptr<ColumnStore>> stores;
+    std::lock_guard<std::mutex> guard(mutex);
+    auto store = stores[dir].lock();
+    if (!store){
+      store.reset(new ColumnStore(dir));
+      stores[dir] = store;
+    }
+    return store;
+  }
+
+  static bool exists(TString dir){
+    return !gSystem->AccessPathName(dir + "/schema.json");
+  }
+
+  ~ColumnStore(){
+    for (auto &m : maps_) munmap(m.first, m.second);
+  }
+
+  Long64_t entries() const { return nentries_; }
+  const TString& presel() const { return presel_; }
+
+  bool matches(const TString &presel) const {
+    // true if the store was written with the preselection *presel* (whitespace ignored), warns once otherwise
+    auto strip = [](TString s){ s.ReplaceAll(" ", ""); s.ReplaceAll("\t", ""); s.ReplaceAll("\n", ""); return s; };
+    if (strip(presel_) == strip(presel)) return true;
+    if (!warned_.exchange(true))
+      cerr << "### ColumnStore: " << dir_ << " was written with presel \"" << presel_ << "\", not \"" << presel
+           << "\", reading the tree instead" << endl;
+    return false;
+  }
+  bool has(const TString &expr) const { return columns_.count(expr); }
+
+  const Column& column(const TString &expr) const {
+    auto it = columns_.find(expr);
+    if (it == columns_.end())
+      throw std::invalid_argument(("ColumnStore: no column \"" + expr + "\" in " + dir_ + ", write the store with it").Data());
+    return it->second;
+  }
+
+  vector<const Column*> selection(const TString &sel) const {
+    vector<const Column*> cols;
+    for (const auto &t : splitConjuncts(sel)) cols.push_back(&column(t));
+    return cols;
+  }
+
+  static bool pass(const vector<const Column*> &sel, Long64_t entry){
+    for (const auto *c : sel) if (c->first(entry)==0) return false;
+    return true;
+  }
+
+protected:
+  ColumnStore(TString dir) : dir_(dir) {
+    std::ifstream fschema((dir + "/schema.json").Data());
+    if (!fschema.good())
+      throw std::invalid_argument(("ColumnStore: no schema.json in " + dir).Data());
+    json schema;
+    fschema >> schema;
+    nentries_ = schema["nentries"].get<Long64_t>();
+    presel_ = schema["presel"].get<std::string>().c_str();
+    for (const auto &c : schema["columns"]){
+      Column col;
+      TString base = dir + "/" + c["file"].get<std::string>();
+      size_t bytes = 0;
+      col.values = static_cast<const double*>(mapFile(base + ".bin", bytes));
+      col.nvalues = bytes/sizeof(double);
+      if (c["jagged"].get<bool>()){
+        size_t cbytes = 0;
+        auto *cnt = static_cast<const uint32_t*>(mapFile(base + ".cnt", cbytes));
+        col.offsets.resize(nentries_+1, 0);
+        for (Long64_t i=0; i<nentries_; ++i) col.offsets[i+1] = col.offsets[i] + cnt[i];
+      }else if ((Long64_t)col.nvalues != nentries_){
+        throw std::invalid_argument(("ColumnStore: " + base + ".bin has the wrong size").Data());
+      }
+      columns_[c["expr"].get<std::string>().c_str()] = std::move(col);
+    }
+  }
+
+  const void* mapFile(const TString &fname, size_t &bytes){
+    int fd = ::open(fname.Data(), O_RDONLY);
+    if (fd < 0) throw std::invalid_argument(("ColumnStore: cannot open " + fname).Data());
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+      ::close(fd);
+      throw std::invalid_argument(("ColumnStore: cannot stat " + fname).Data());
+    }
+    bytes = st.st_size;
+    if (bytes==0){ ::close(fd); return nullptr; }
+    void *p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) throw std::invalid_argument(("ColumnStore: cannot map " + fname).Data());
+    maps_.emplace_back(p, bytes);
+    return p;
+  }
+
+  TString dir_;
+  Long64_t nentries_ = 0;
+  TString presel_;
+  mutable std::atomic<bool> warned_{false};
+  map<TString, Column> columns_;
+  vector<pair<void*, size_t>> maps_;
+
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// kernels on a column store, same semantics as HistBooker: selection and weight from the first instance,
+// the plotted variable filled for every instance
+
+TH1D* getHist(const ColumnStore &store, TString plotvar, TString wgtvar, TString sel, TString hname, TString title, std::vector<double> xbins){
+  TH1D* hist = new TH1D(hname, title, xbins.size()-1, xbins.data());
+  hist->Sumw2();
+  const auto &var = store.column(plotvar);
+  const auto &wgt = store.column(wgtvar);
+  auto cuts = store.selection(sel);
+  for (Long64_t i=0; i<store.entries(); ++i){
+    if (!ColumnStore::pass(cuts, i)) continue;
+    double w = wgt.first(i);
+    if (w==0) continue;
+    const double *x = var.at(i);
+    for (uint32_t k=0; k<var.size(i); ++k) hist->Fill(x[k], w);
+  }
+  return hist;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+vector<Quantity> getYieldVector(const ColumnStore &store, TString wgtvar, TString sel, const BinInfo &bin){
+  TH1D *htmp = getHist(store, bin.var, wgtvar, sel, "htmp_colstore", "", bin.plotbins);
+  htmp->SetDirectory(nullptr);
+  addOverflow(htmp);
+  vector<Quantity> yields;
+  for (unsigned i=0; i<bin.nbins; ++i)
+    yields.push_back(getHistBin(htmp, i+1));
+  delete htmp;
+  return yields;
+}
+
+}
+#endif /*ESTTOOLS_COLUMNSTORE_HH_*/
@@ -8,11 +8,20 @@
 #include <memory>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
 #include "TROOT.h"
 #include "TSystem.h"
 #include "TString.h"
 #include "TFile.h"
 #include "TTree.h"
+#include "TChain.h"
+#include "TRegexp.h"
+#include "TObjArray.h"
+#include "TObjString.h"
 #include "TH1.h"
 #include "TF1.h"
 #include "TGraph.h"
@@ -22,6 +31,7 @@
 #include "TMath.h"
 
 #include "Quantity.h"
+#include "FileCache.hh"
 
 using namespace std;
 #endif
@@ -149,56 +159,102 @@ struct Category{
 
 
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-class Sample{
-  // struct to store information of a sample (ROOT trees)
+class LazyTree{
+  // a TTree* that opens its file on first access (or a TChain of its files, for multi-file samples)
+  // copies share the same file/tree, and the first access from any thread opens it exactly once
 
 public:
-  Sample() : tree(nullptr) {}
-  Sample(TString name, TString label, TString fname, TString filepath, TString wgtvar, TString sel = "") :
-    name(name), label(label), fname(fname), filepath(filepath), wgtvar(wgtvar), sel(sel), tree(nullptr) {
-    TDirectory::TContext ctxt; // Will restore gDirectory to its 'current' value at the end of this scope
-    TFile *f = TFile::Open(filepath);
-    infile.reset(f);
-    assert(infile);
-    infile->GetObject(treename, tree);
-    assert(tree);
-    tree->SetTitle(name);
+  LazyTree() {}
+  LazyTree(TString filepath, TString treename, TString title) : state_(std::make_shared<State>()) {
+    state_->filepath = filepath;
+    state_->treename = treename;
+    state_->title = title;
+  }
+  LazyTree(const std::vector<TString> &files, TString treename, TString title) : LazyTree(files.empty() ? "" : files.front(), treename, title) {
+    state_->files = files;
+  }
+
+  TTree* get() const {
+    if (!state_) return nullptr;
+    open();
+    return state_->tree;
   }
-  Sample(const Sample &o) : name(o.name), label(o.label), fname(o.fname), filepath(o.filepath), wgtvar(o.wgtvar), sel(o.sel), tree(o.tree),
-      infile(o.infile) {}
-  Sample(Sample &&o) : name(o.name), label(o.label), fname(o.fname), filepath(o.filepath), wgtvar(o.wgtvar), sel(o.sel), tree(o.tree),
-      infile(std::move(o.infile)) {}
-
-  Sample &operator=(const Sample &o){
-    if (this != &o){
-      name = o.name;
-      label = o.label;
-      fname = o.fname;
-      wgtvar = o.wgtvar;
-      sel = o.sel;
-      filepath = o.filepath;
-      treename = o.treename;
-      infile = o.infile;
-      tree = o.tree;
+  operator TTree*() const { return get(); }
+  TTree* operator->() const { return get(); }
+
+  void open() const {
+    std::lock_guard<std::mutex> guard(state_->mutex);
+    if (state_->tree) return;
+    TDirectory::TContext ctxt; // Will restore gDirectory to its 'current' value at the end of this scope
+    auto start = std::chrono::steady_clock::now();
+    if (!state_->files.empty()){
+      openChain();
+    }else{
+      TFile *f = FileCache::instance().open(state_->filepath);
+      if (!f || f->IsZombie())
+        throw std::invalid_argument(("LazyTree: cannot open file " + state_->filepath).Data());
+      state_->file.reset(f);
+      TTree *t = nullptr;
+      f->GetObject(state_->treename, t);
+      if (!t)
+        throw std::invalid_argument(("LazyTree: no tree " + state_->treename + " in " + state_->filepath).Data());
+      t->SetTitle(state_->title);
+      state_->tree = t;
     }
-    return *this;
+    cerr << "### Opened " << (state_->files.empty() ? "file " + state_->filepath : TString::Format("%zu files", state_->files.size()))
+         << " as *" << state_->title << "* ("
+         << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms)" << endl;
+  }
+
+  bool isOpen() const {
+    if (!state_) return false;
+    std::lock_guard<std::mutex> guard(state_->mutex);
+    return state_->tree != nullptr;
   }
-  // implement move
-  Sample &operator=(Sample &&o){
-    if (this != &o){
-      name = o.name;
-      label = o.label;
-      fname = o.fname;
-      wgtvar = o.wgtvar;
-      sel = o.sel;
-      filepath = o.filepath;
-      treename = o.treename;
-      infile = std::move(o.infile);
-      tree = o.tree;
+
+private:
+  void openChain() const {
+    // remote files are fetched a few at a time first and stay pinned in the FileCache while the chain lives,
+    // the chain then only sees local copies
+    // (nentries = 0: every file is opened once here, so a missing file fails now and not mid-loop)
+    auto locals = FileCache::instance().fetchAll(state_->files);
+    state_->pinned = state_->files;
+    auto *chain = new TChain(state_->treename, state_->title);
+    state_->chain.reset(chain);
+    for (unsigned i=0; i<locals.size(); ++i){
+      if (chain->AddFile(locals.at(i), 0) == 0)
+        throw std::invalid_argument(("LazyTree: cannot add " + state_->files.at(i) + " to the chain " + state_->title).Data());
     }
-    return *this;
+    state_->tree = chain;
   }
 
+  struct State{
+    TString filepath;
+    std::vector<TString> files; // non-empty: a TChain of these
+    TString treename;
+    TString title;
+    std::mutex mutex;
+    std::shared_ptr<TFile> file;
+    std::shared_ptr<TChain> chain;
+    TTree *tree = nullptr;
+    std::vector<TString> pinned; // FileCache pins of the chain members
+
+    ~State() { for (const auto &f : pinned) FileCache::instance().unpin(f); }
+  };
+  std::shared_ptr<State> state_;
+
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class Sample{
+  // struct to store information of a sample (ROOT trees)
+  // the file is only opened when *tree* is first used (or by BaseConfig::prefetchSamples)
+
+public:
+  Sample() {}
+  Sample(TString name, TString label, TString fname, TString filepath, TString wgtvar, TString sel = "") :
+    name(name), label(label), fname(fname), wgtvar(wgtvar), sel(sel), filepath(filepath), tree(filepath, treename, name) {}
+
   TString name;   // name of the sample
   TString label;  // plotting label for the sample, e.g., t#bar{t}
   TString fname;  // filename
@@ -207,13 +263,67 @@ public:
 
   TString filepath;
   TString treename = "Events";
-  TTree*  tree;   // the tree
+  LazyTree tree;  // the tree (converts to TTree*)
+  TString columndir; // column store of the tree (ColumnStore.hh), if any
+
+  // multi-file sample (BaseConfig::addSample with a normalization table): *tree* chains *files*,
+  // the entries of files[i] are weighted by fileWeights[i] on top of *wgtvar*
+  std::vector<TString> files;
+  std::vector<double> fileWeights;
+
+  bool isMultiFile() const { return !files.empty(); }
+  unsigned nFiles() const { return files.empty() ? 1 : files.size(); }
+  TString filePath(unsigned i) const { return files.empty() ? filepath : files.at(i); }
+  double fileWeight(unsigned i) const { return fileWeights.empty() ? 1 : fileWeights.at(i); }
+
+  TString fileWgtvar(unsigned i) const {
+    // weight expression for the tree of filePath(i) on its own
+    if (fileWeights.empty()) return wgtvar;
+    return TString::Format("%.17g*(%s)", fileWeights.at(i), wgtvar.Data());
+  }
 
-private:
-  std::shared_ptr<TFile> infile; // the root file
+  Sample fileSample(unsigned i) const {
+    // filePath(i) as a sample of its own, without fileWeight(i) (scale its yields by it)
+    Sample s(name, label, fname, filePath(i), wgtvar, sel);
+    s.treename = treename;
+    s.tree = LazyTree(s.filepath, treename, name);
+    return s;
+  }
 
 };
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct SampleNorm{
+  // generator-level normalization of a sample
+  double   xsec = 0;      // cross section (pb)
+  Long64_t nEvents = 0;   // generated events
+  Long64_t nNegative = 0; // of which with negative generator weight
+  double   sumw = 0;      // or: sum of generator weights (SampleRegistry), used instead of the counts if set
+
+  SampleNorm() {}
+  SampleNorm(double xsec, Long64_t nEvents, Long64_t nNegative = 0) : xsec(xsec), nEvents(nEvents), nNegative(nNegative) {}
+
+  double eventWeight() const {
+    // cross section per unit of generator weight, or per effective event: with the generator sign in the event
+    // weight, the events sum to nEvents - 2*nNegative (same effective count as mergeLundJSON.py)
+    if (sumw != 0) return xsec / sumw;
+    Long64_t nEff = nEvents - 2*nNegative;
+    return nEff > 0 ? xsec / nEff : 0;
+  }
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template<typename T>
+typename map<TString, T>::const_iterator findDataset(const map<TString, T> &datasets, const TString &path){
+  // the dataset whose name the file name of *path* contains (the longest one if several do), or end()
+  TString base = gSystem->BaseName(path);
+  auto found = datasets.end();
+  for (auto it = datasets.begin(); it != datasets.end(); ++it){
+    if (base.Contains(it->first) && (found == datasets.end() || it->first.Length() > found->first.Length())) found = it;
+  }
+  return found;
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
 struct BaseConfig {
@@ -233,9 +343,103 @@ struct BaseConfig {
     //     *key of the map*   *plot label*   *filepath (postfix "_tree.root" added by default)*  *weight variable*  *extra selection*
 
     TString filepath = inputdir+"/"+file+"_tree.root";
-    samples.emplace(name, Sample(name, label, file, filepath, wgtvar, extraCut));
+    if (skimdir != ""){
+      // use the slim skim (BaseEstimator::skimSamples) if there is one; opt-in, the skim has to be made
+      // with the same (or a looser) config.sel and all expressions used later
+      TString skimpath = skimdir+"/"+file+"_tree.root";
+      if (!gSystem->AccessPathName(skimpath)) filepath = skimpath;
+    }
+    Sample sample(name, label, file, filepath, wgtvar, extraCut);
+    if (columndir != "" && !gSystem->AccessPathName(columndir+"/"+file+"/schema.json")){
+      // yields from the memory-mapped column store (BaseEstimator::writeColumnStores) if there is one, as long as
+      // it was written with the config.sel in use when the yields are computed (ColumnStore::matches)
+      sample.columndir = columndir+"/"+file;
+    }
+    samples.emplace(name, sample);
 
-    cerr << "### Open file " << filepath << " as *" << name << "*" << endl;
+    cerr << "### Add file " << filepath << " as *" << name << "* (opened on first use)" << endl;
+  }
+
+  void addSample(TString name, TString label, TString files, TString wgtvar, TString extraCut, const map<TString, SampleNorm> &norms){
+    // add a sample made of many files (e.g. the per-job outputs of several datasets, without hadd'ing them), e.g.
+    // addSample("diboson", "VV",         "diboson/ww,diboson/wz/*.root",             lumi+"*1000*genSign",       "",   norms);
+    //                                    *directories or wildcards in inputdir*      *weight variable*           *extra selection*  *dataset -> SampleNorm*
+    // the sample tree is a TChain of the files; every file is weighted by SampleNorm::eventWeight() of the dataset
+    // whose name it contains (longest match), so the dataset normalizations are applied on the fly
+    auto paths = matchFiles(files);
+    if (paths.empty())
+      throw std::invalid_argument(("BaseConfig::addSample: no files match " + files + " in " + inputdir).Data());
+
+    Sample sample(name, label, files, inputdir+"/"+files, wgtvar, extraCut);
+    for (const auto &path : paths){
+      auto norm = findDataset(norms, path);
+      if (norm == norms.end())
+        throw std::invalid_argument(("BaseConfig::addSample: no normalization for " + path + " in sample " + name).Data());
+      sample.files.push_back(path);
+      sample.fileWeights.push_back(norm->second.eventWeight());
+    }
+    sample.tree = LazyTree(sample.files, sample.treename, name);
+    samples.emplace(name, sample);
+
+    cerr << "### Add " << paths.size() << " files " << files << " in " << inputdir << " as *" << name << "* (opened on first use)" << endl;
+  }
+
+  vector<TString> matchFiles(TString files) const {
+    // the files of the comma-separated directories/wildcards *files* in inputdir (see listFiles)
+    vector<TString> paths;
+    std::unique_ptr<TObjArray> patterns(files.Tokenize(","));
+    for (Int_t i=0; i<patterns->GetEntries(); ++i){
+      auto more = listFiles(inputdir+"/"+((TObjString*)patterns->At(i))->String());
+      paths.insert(paths.end(), more.begin(), more.end());
+    }
+    return paths;
+  }
+
+  static vector<TString> listFiles(TString pattern){
+    // the .root files in directory *pattern*, or the files matching a wildcard in its last component; sorted
+    TString dir = pattern, wildcard = "*.root";
+    if (pattern.MaybeWildcard()){
+      dir = gSystem->DirName(pattern);
+      wildcard = gSystem->BaseName(pattern);
+    }
+    vector<TString> paths;
+    void *dirp = gSystem->OpenDirectory(dir);
+    if (!dirp) return paths;
+    TRegexp re(wildcard, true);
+    while (const char *entry = gSystem->GetDirEntry(dirp)){
+      TString fname = entry;
+      if (fname=="." || fname=="..") continue;
+      Ssiz_t len = 0;
+      if (re.Index(fname, &len)==0 && len==fname.Length()) paths.push_back(dir+"/"+fname);
+    }
+    gSystem->FreeDirectory(dirp);
+    std::sort(paths.begin(), paths.end());
+    return paths;
+  }
+
+  void prefetchSamples(){
+    // open the files of all samples concurrently, so that the startup latency is that of the slowest file
+    // instead of the sum over all files (samples are otherwise opened lazily, one by one, on first use)
+    ROOT::EnableThreadSafety();
+    auto start = chrono::steady_clock::now();
+    std::vector<std::thread> pool;
+    std::mutex error_mutex;
+    TString errors;
+    for (const auto &s : samples){
+      if (s.second.tree.isOpen()) continue;
+      const LazyTree &tree = s.second.tree;
+      pool.emplace_back([&tree, &errors, &error_mutex](){
+        try{
+          tree.open();
+        }catch (const std::exception &e){
+          std::lock_guard<std::mutex> guard(error_mutex);
+          errors += TString(e.what()) + "\n";
+        }
+      });
+    }
+    for (auto && t : pool) t.join();
+    if (errors != "") throw std::invalid_argument(errors.Data());
+    cerr << "### Prefetched " << pool.size() << " files in " << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
   }
 
   unsigned nbins(){
@@ -271,6 +475,8 @@ public:
   map<TString, TString>  crMapping; // map from SR name to CR name
 
   TString inputdir;                 // location of ROOT trees
+  TString skimdir;                  // location of slim skims of the trees (used instead of inputdir if present)
+  TString columndir;                // location of column stores of the trees (used for the yields if present)
   TString outputdir;                // location of output plots
   TString plotFormat;               // format of plots
 
@@ -0,0 +1,271 @@
+#ifndef ESTTOOLS_CUTOPTIMIZER_HH_
+#define ESTTOOLS_CUTOPTIMIZER_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include "THnSparse.h"
+#include "TRandom3.h"
+
+#include "Threading.hh"
+#include "MiniTools.hh"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class CutOptimizer{
+  // Optimize one-sided cuts on several variables at once from N-dim histograms (e.g. BaseEstimator::getSparseHists),
+  // without reading the trees again.
+  //  * the signal and background histograms are summed and turned into dense N-dim cumulative sums
+  //    (one per cut direction), so each candidate cut set is a single lookup
+  //  * candidates are the bin edges of each axis (position 0 = no cut on that axis)
+  //  * figure of merit is the Asimov Z, with an optional relative background uncertainty
+  //  * gridSearch() and coordinateDescent() evaluate candidates on all cores (with ESTTOOLS_MULTITHREAD, see
+  //    Threading.hh)
+
+public:
+  struct CutSet{
+    vector<int>    pos;   // candidate position on each axis (0: no cut)
+    vector<double> cuts;  // threshold on each axis (ignored if pos==0)
+    Quantity       sig;
+    Quantity       bkg;
+    double         z = -1;
+  };
+
+  CutOptimizer(const map<TString, THnBase*>& hists, const vector<TString>& sig_samples, const vector<TString>& bkg_samples, const vector<bool>& greaterThan) :
+    greaterThan_(greaterThan) {
+    if (sig_samples.empty() || bkg_samples.empty())
+      throw std::invalid_argument("CutOptimizer: need at least one signal and one background sample");
+    const THnBase *ref = hists.at(sig_samples.front());
+    int ndim = ref->GetNdimensions();
+    if ((int)greaterThan_.size() != ndim)
+      throw std::invalid_argument("CutOptimizer: one cut direction per axis is needed");
+
+    Long64_t total = 1;
+    for (int d=0; d<ndim; ++d){
+      const TAxis *ax = ref->GetAxis(d);
+      vars_.push_back(ax->GetName());
+      nbins_.push_back(ax->GetNbins());
+      strides_.push_back(total);
+      total *= ax->GetNbins()+2;
+      vector<double> edges;
+      for (int i=1; i<=ax->GetNbins()+1; ++i) edges.push_back(ax->GetBinLowEdge(i));
+      edges_.push_back(edges);
+    }
+    // four dense arrays (signal, background and their errors) of *total* doubles
+    if (total > MAX_BYTES / Long64_t(4*sizeof(double)))
+      throw std::invalid_argument("CutOptimizer: " + std::to_string(total) + " cells need " + std::to_string(total*4*sizeof(double)/(1024*1024))
+                                  + " MB, more than " + std::to_string(MAX_BYTES/(1024*1024)) + " MB, use a coarser binning");
+
+    sig_.assign(total, 0); sigErr2_.assign(total, 0);
+    bkg_.assign(total, 0); bkgErr2_.assign(total, 0);
+    for (const auto &s : sig_samples) addHist(hists.at(s), sig_, sigErr2_);
+    for (const auto &s : bkg_samples) addHist(hists.at(s), bkg_, bkgErr2_);
+    for (auto *v : {&sig_, &sigErr2_, &bkg_, &bkgErr2_}) accumulate(*v);
+  }
+
+  void setBkgUncertainty(double relUnc) { bkgRelUnc_ = relUnc; }
+  void setMinBkg(double minBkg) { minBkg_ = minBkg; }
+  void setMinSig(double minSig) { minSig_ = minSig; }
+
+  unsigned ndim() const { return vars_.size(); }
+  unsigned ncandidates(unsigned d) const { return nbins_.at(d)+1; }
+
+  CutSet evaluate(const vector<int>& pos) const {
+    CutSet cs;
+    cs.pos = pos;
+    Long64_t idx = 0;
+    for (unsigned d=0; d<ndim(); ++d){
+      int t = cellIndex(d, pos[d]);
+      idx += t*strides_[d];
+      cs.cuts.push_back(pos[d]==0 ? 0 : (greaterThan_[d] ? edges_[d].at(t-1) : edges_[d].at(t)));
+    }
+    cs.sig = Quantity(sig_[idx], std::sqrt(sigErr2_[idx]));
+    cs.bkg = Quantity(bkg_[idx], std::sqrt(bkgErr2_[idx]));
+    if (cs.bkg.value < minBkg_ || cs.sig.value < minSig_) cs.z = -1;
+    else cs.z = asimovZ(cs.sig.value, cs.bkg.value, bkgRelUnc_*cs.bkg.value);
+    return cs;
+  }
+
+  vector<CutSet> gridSearch(unsigned nBest = 10, int stride = 1) const {
+    // all combinations of every *stride*-th candidate on each axis, returns the *nBest* best sorted by Z
+    vector<vector<int>> cands(ndim());
+    Long64_t ncomb = 1;
+    for (unsigned d=0; d<ndim(); ++d){
+      for (unsigned p=0; p<ncandidates(d); p+=stride) cands[d].push_back(p);
+      ncomb *= cands[d].size();
+    }
+
+    vector<CutSet> best;
+    std::mutex best_mutex;
+    auto searchRange = [&](Long64_t first, Long64_t last){
+      vector<CutSet> local;
+      vector<int> pos(ndim());
+      for (Long64_t k=first; k<last; ++k){
+        Long64_t rem = k;
+        for (unsigned d=0; d<ndim(); ++d){
+          pos[d] = cands[d][rem % cands[d].size()];
+          rem /= cands[d].size();
+        }
+        auto cs = evaluate(pos);
+        if (cs.z < 0) continue;
+        insertBest(local, cs, nBest);
+      }
+      std::lock_guard<std::mutex> guard(best_mutex);
+      for (auto &cs : local) insertBest(best, cs, nBest);
+    };
+
+    runParallel(ncomb, searchRange);
+#ifdef DEBUG_
+    cout << "CutOptimizer::gridSearch: " << ncomb << " cut sets evaluated" << endl;
+#endif
+    return best;
+  }
+
+  vector<CutSet> coordinateDescent(unsigned nStarts = 8, unsigned maxIter = 50, unsigned seed = 4357) const {
+    // coordinate descent from the loosest cut set and *nStarts*-1 random ones (run in parallel),
+    // returns the converged cut set of each start sorted by Z
+    vector<vector<int>> starts(1, vector<int>(ndim(), 0));
+    TRandom3 rnd(seed);
+    for (unsigned i=1; i<nStarts; ++i){
+      vector<int> pos;
+      for (unsigned d=0; d<ndim(); ++d) pos.push_back(rnd.Integer(ncandidates(d)));
+      starts.push_back(pos);
+    }
+
+    vector<CutSet> results(starts.size());
+    auto descend = [&](Long64_t first, Long64_t last){
+      for (Long64_t istart=first; istart<last; ++istart){
+        auto current = evaluate(starts.at(istart));
+        for (unsigned iter=0; iter<maxIter; ++iter){
+          bool improved = false;
+          for (unsigned d=0; d<ndim(); ++d){
+            auto pos = current.pos;
+            for (unsigned p=0; p<ncandidates(d); ++p){
+              pos[d] = p;
+              auto cs = evaluate(pos);
+              if (cs.z > current.z + 1e-9){ current = cs; improved = true; }
+            }
+          }
+          if (!improved) break;
+        }
+        results[istart] = current;
+      }
+    };
+
+    runParallel(starts.size(), descend);
+    std::sort(results.begin(), results.end(), [](const CutSet &a, const CutSet &b){ return a.z > b.z; });
+    return results;
+  }
+
+  TString selection(const CutSet& cs) const {
+    // the cut set as a selection string, e.g. to put into SRParameters.hh
+    TString sel;
+    for (unsigned d=0; d<ndim(); ++d){
+      if (cs.pos.at(d)==0) continue;
+      if (sel != "") sel += " && ";
+      sel += vars_[d] + (greaterThan_[d] ? " > " : " < ") + TString::Format("%g", cs.cuts.at(d));
+    }
+    return sel;
+  }
+
+  void print(const vector<CutSet>& sets, TString title = "") const {
+    if (title!="") cout << title << endl;
+    cout << setw(10) << "Z_A" << "\t" << setw(20) << "S" << "\t" << setw(20) << "B" << "\t" << "Selection" << endl;
+    for (const auto &cs : sets){
+      cout << fixed << setprecision(4) << setw(10) << cs.z << "\t" << setprecision(2) << setw(20) << cs.sig << "\t" << setw(20) << cs.bkg << "\t"
+           << (cs.pos.empty() ? TString("") : selection(cs)) << endl;
+    }
+    cout << endl;
+  }
+
+protected:
+  int cellIndex(unsigned d, int pos) const {
+    // cell of the cumulative sum for candidate *pos* on axis *d*
+    // >: cells pos..overflow, pos=0 includes the underflow; <: cells underflow..t, pos=0 includes the overflow
+    if (greaterThan_[d]) return pos;
+    return pos==0 ? nbins_[d]+1 : nbins_[d]+1-pos;
+  }
+
+  void addHist(const THnBase *hn, vector<double>& content, vector<double>& err2) const {
+    if (hn->GetNdimensions() != (int)ndim())
+      throw std::invalid_argument(("CutOptimizer: " + TString(hn->GetName()) + " has a different number of axes").Data());
+    vector<Int_t> coord(ndim());
+    for (Long64_t i=0; i<hn->GetNbins(); ++i){
+      double c = hn->GetBinContent(i, coord.data());
+      Long64_t idx = 0;
+      for (unsigned d=0; d<ndim(); ++d) idx += coord[d]*strides_[d];
+      content[idx] += c;
+      err2[idx] += hn->GetBinError2(i);
+    }
+  }
+
+  void accumulate(vector<double>& v) const {
+    // in-place N-dim cumulative sum: from the top along > axes, from the bottom along < axes
+    Long64_t total = v.size();
+    for (unsigned d=0; d<ndim(); ++d){
+      Long64_t s = strides_[d];
+      int n = nbins_[d]+2;
+      if (greaterThan_[d]){
+        for (Long64_t f=total-1; f>=0; --f){
+          if ((f/s) % n < n-1) v[f] += v[f+s];
+        }
+      }else{
+        for (Long64_t f=0; f<total; ++f){
+          if ((f/s) % n > 0) v[f] += v[f-s];
+        }
+      }
+    }
+  }
+
+  static void insertBest(vector<CutSet>& best, const CutSet& cs, unsigned nBest){
+    auto it = std::upper_bound(best.begin(), best.end(), cs, [](const CutSet &a, const CutSet &b){ return a.z > b.z; });
+    if (it - best.begin() >= (long)nBest) return;
+    best.insert(it, cs);
+    if (best.size() > nBest) best.pop_back();
+  }
+
+  template<typename Func>
+  static void runParallel(Long64_t n, Func func){
+    // split [0, n) into contiguous chunks, one per thread
+#ifdef ESTTOOLS_MULTITHREAD
+    const Long64_t nMax = std::max(std::thread::hardware_concurrency()*0.8, std::thread::hardware_concurrency()-2.);
+    const Long64_t nThreads = std::max(Long64_t(1), std::min(nMax, n));
+    const Long64_t chunk = (n + nThreads - 1) / nThreads;
+    std::vector<std::thread> pool;
+    for (Long64_t first=0; first<n; first+=chunk)
+      pool.emplace_back(func, first, std::min(first+chunk, n));
+    for (auto && t : pool) t.join();
+#else
+    func(0, n);
+#endif
+  }
+
+  static constexpr Long64_t MAX_BYTES = 2LL*1024*1024*1024;
+
+  vector<bool>           greaterThan_;
+  vector<TString>        vars_;
+  vector<int>            nbins_;
+  vector<Long64_t>       strides_;
+  vector<vector<double>> edges_;
+
+  vector<double> sig_, sigErr2_, bkg_, bkgErr2_;
+
+  double bkgRelUnc_ = 0;
+  double minBkg_ = 0;
+  double minSig_ = 0;
+
+};
+
+}
+#endif /*ESTTOOLS_CUTOPTIMIZER_HH_*/
@@ -14,6 +14,10 @@
 #include <unordered_map>
 #include <set>
 #include <TTreeFormula.h>
+#include <TLeaf.h>
+#include <TBranch.h>
+#include <THnSparse.h>
+#include <TLegendEntry.h>
 
 #include "json.hpp"
 #include "MiniTools.hh"
@@ -132,6 +136,67 @@ Quantity getEfficiency(TTree *t, TString wgtvar, TString basesel, TString extras
   return getYields(t, wgtvar, basesel+" && "+extrasel) / getYields(t, wgtvar, basesel);
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class BranchCollector : public TTreeFormula {
+  // TTreeFormula keeps the branches read inside variable indices (e.g. SVFit_Index in x[SVFit_Index[0]]),
+  // aliases and special functions in sub-formulas of its own; this walks all of them. Only the protected members
+  // of *this* are read, the sub-formulas are compiled again from their expression as BranchCollectors of their own
+public:
+  BranchCollector(const char *name, const char *formula, TTree *tree) : TTreeFormula(name, formula, tree) {}
+
+  void collect(std::set<TString> &branches) const {
+    for (int i=0; i<fLeaves.GetEntriesFast(); ++i){
+      auto *leaf = dynamic_cast<TLeaf*>(fLeaves.At(i));
+      if (leaf) branches.insert(leaf->GetBranch()->GetName());
+    }
+    for (int i=0; i<fNcodes; ++i)
+      for (int k=0; k<kMAXFORMDIM; ++k) collectSub(fVarIndexes[i][k], branches);
+    for (auto *arr : {&fAliases, &fExternalCuts})
+      for (int i=0; i<arr->GetEntriesFast(); ++i) collectSub(dynamic_cast<const TTreeFormula*>(arr->At(i)), branches);
+  }
+
+private:
+  static void collectSub(const TTreeFormula *sub, std::set<TString> &branches){
+    if (!sub || !sub->GetTree()) return;
+    BranchCollector bc(sub->GetName(), sub->GetTitle(), sub->GetTree());
+    if (bc.GetNdim()!=0) bc.collect(branches);
+  }
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+std::set<TString> getReferencedBranches(TTree *intree, const vector<TString> &exprs){
+  // names of the branches read by the given expressions (as resolved by TTreeFormula, incl. aliases, array indices
+  // and the branches read inside variable indices)
+  assert(intree);
+  std::set<TString> branches;
+  for (const auto &expr : exprs){
+    if (expr.IsWhitespace()) continue;
+    BranchCollector f("refbranches", expr, intree);
+    if (f.GetNdim()==0)
+      throw std::invalid_argument(("getReferencedBranches: cannot compile expression \"" + expr + "\" on tree " + intree->GetTitle()).Data());
+    f.collect(branches);
+  }
+  return branches;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+Long64_t warmUpTree(TTree *intree, const std::set<TString> &branches, Long64_t maxBytes, Long64_t cacheSize = 64*1024*1024){
+  // read the baskets of *branches* in entry order (through a TTreeCache) until *maxBytes* were read, so that a
+  // following pass over the same file finds them in the OS page cache; returns the bytes read (compressed)
+  assert(intree);
+  intree->SetBranchStatus("*", 0);
+  for (const auto &b : branches) intree->SetBranchStatus(b, 1);
+  intree->SetCacheSize(cacheSize);
+  for (const auto &b : branches) intree->AddBranchToCache(b, true);
+  intree->StopCacheLearningPhase();
+  Long64_t bytes = 0;
+  for (Long64_t i=0; i<intree->GetEntries() && bytes<maxBytes; ++i){
+    bytes += intree->GetEntry(i);
+  }
+  intree->SetBranchStatus("*", 1);
+  return bytes;
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 TH1D* getHist(TTree *intree, TString plotvar, TString wgtvar, TString sel, TString hname, TString title, int nbinsx, double xmin, double xmax){
   TH1D* hist = new TH1D(hname, title, nbinsx, xmin, xmax);
@@ -176,6 +241,67 @@ TH2D* getHist2D(TTree *intree, TString plotvar, TString wgtvar, TString sel, TSt
   return hist;
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Projections and slices of (sparse) N-dim histograms, e.g. the Lund plane filled by HistBooker::bookSparse.
+// *slices* maps axis index -> [low, high) range in axis units, checked on the bin center.
+// Only filled bins are visited and under/overflow are kept, so the 1D projections match what
+// getHist() would give for the same variable and selection.
+bool passSlices(const THnBase *hn, const Int_t *coord, const map<int, pair<double, double>> &slices){
+  for (const auto &sl : slices){
+    double x = hn->GetAxis(sl.first)->GetBinCenter(coord[sl.first]);
+    if (x < sl.second.first || x >= sl.second.second) return false;
+  }
+  return true;
+}
+
+TH1D* projectSparse(const THnBase *hn, int axis, TString hname, const map<int, pair<double, double>> &slices = {}){
+  const TAxis *ax = hn->GetAxis(axis);
+  TString title = TString(";") + ax->GetTitle() + ";Events";
+  TH1D *hist = ax->GetXbins()->GetSize() ?
+      new TH1D(hname, title, ax->GetNbins(), ax->GetXbins()->GetArray()) :
+      new TH1D(hname, title, ax->GetNbins(), ax->GetXmin(), ax->GetXmax());
+  hist->Sumw2();
+
+  vector<Int_t> coord(hn->GetNdimensions());
+  for (Long64_t i=0; i<hn->GetNbins(); ++i){
+    double content = hn->GetBinContent(i, coord.data());
+    if (!passSlices(hn, coord.data(), slices)) continue;
+    int ibin = coord.at(axis);
+    hist->SetBinContent(ibin, hist->GetBinContent(ibin) + content);
+    (*hist->GetSumw2())[ibin] += hn->GetBinError2(i);
+  }
+  return hist;
+}
+
+TH2D* projectSparse2D(const THnBase *hn, int xaxis, int yaxis, TString hname, const map<int, pair<double, double>> &slices = {}){
+  const TAxis *ax = hn->GetAxis(xaxis);
+  const TAxis *ay = hn->GetAxis(yaxis);
+  TString title = TString(";") + ax->GetTitle() + ";" + ay->GetTitle() + ";Events";
+  vector<double> xbins, ybins;
+  for (int i=1; i<=ax->GetNbins()+1; ++i) xbins.push_back(ax->GetBinLowEdge(i));
+  for (int i=1; i<=ay->GetNbins()+1; ++i) ybins.push_back(ay->GetBinLowEdge(i));
+  TH2D *hist = new TH2D(hname, title, xbins.size()-1, xbins.data(), ybins.size()-1, ybins.data());
+  hist->Sumw2();
+
+  vector<Int_t> coord(hn->GetNdimensions());
+  for (Long64_t i=0; i<hn->GetNbins(); ++i){
+    double content = hn->GetBinContent(i, coord.data());
+    if (!passSlices(hn, coord.data(), slices)) continue;
+    int ibin = hist->GetBin(coord.at(xaxis), coord.at(yaxis));
+    hist->SetBinContent(ibin, hist->GetBinContent(ibin) + content);
+    (*hist->GetSumw2())[ibin] += hn->GetBinError2(i);
+  }
+  return hist;
+}
+
+int findSparseAxis(const THnBase *hn, TString var){
+  // axis index from the variable name (HistBooker::bookSparse names the axes after BinInfo::var)
+  for (int i=0; i<hn->GetNdimensions(); ++i){
+    if (var == hn->GetAxis(i)->GetName()) return i;
+  }
+  throw std::invalid_argument(("findSparseAxis: no axis " + var + " in " + hn->GetName()).Data());
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 vector<TH1*> makeRatioHists(vector<TH1*> num, vector<TH1*> denom, TString option = ""){
   assert(num.size() == denom.size());
@@ -219,6 +345,26 @@ TH1* makeRatioHists(TH1* nonTTbar, TH1* TTbar, TH1* data, TString option = ""){
   return hnum;
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+TH2* makeSigBkgMap(const TH2* sig, const TH2* bkg, bool sqrtBkg = false){
+  // per-cell S/B (or S/sqrt(B) if *sqrtBkg*), cells without background are left empty
+  assert(sig && bkg);
+  auto hmap = (TH2*)sig->Clone(sig->GetName() + TString(sqrtBkg ? "__SoverSqrtB__" : "__SoverB__") + bkg->GetName());
+  hmap->Reset();
+  hmap->GetZaxis()->SetTitle(sqrtBkg ? "S/#sqrt{B}" : "S/B");
+  for (int i=1; i<=sig->GetNbinsX(); ++i){
+    for (int j=1; j<=sig->GetNbinsY(); ++j){
+      auto s = Quantity(sig->GetBinContent(i, j), sig->GetBinError(i, j));
+      auto b = Quantity(bkg->GetBinContent(i, j), bkg->GetBinError(i, j));
+      if (b.value <= 0) continue;
+      auto r = s / (sqrtBkg ? b.power(0.5) : b);
+      hmap->SetBinContent(i, j, r.value);
+      hmap->SetBinError(i, j, r.error);
+    }
+  }
+  return hmap;
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 TCanvas* drawComp(vector<TH1*> inhists, TLegend *leg = 0)
 {
@@ -574,6 +720,40 @@ TCanvas* drawStack(vector<TH1*> bkghists, vector<TH1*> sighists, bool plotlog =
   return c;
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+TCanvas* drawHist2D(const TH2 *inhist, bool plotlog = false, TString drawopt = "COLZ", double zmin = 0, double zmax = -1)
+{
+  // 2D histogram with the z axis (palette) on the right, *zmax* < *zmin* means automatic range
+  auto h = (TH2*)inhist->Clone();
+  auto c = MakeCanvas();
+  c->cd();
+  c->SetRightMargin(0.18);
+  c->SetLogz(plotlog);
+  h->GetXaxis()->SetTitleFont(42);
+  h->GetYaxis()->SetTitleFont(42);
+  h->GetZaxis()->SetTitleFont(42);
+  h->GetXaxis()->SetLabelFont(42);
+  h->GetYaxis()->SetLabelFont(42);
+  h->GetZaxis()->SetLabelFont(42);
+  h->GetZaxis()->SetTitleOffset(1.3);
+  if (zmax > zmin){
+    h->SetMinimum(zmin);
+    h->SetMaximum(zmax);
+  }else if (plotlog){
+    h->SetMinimum(LOG_YMIN);
+  }
+  h->Draw(drawopt);
+#ifdef DEBUG_
+  cout << "-->drawing drawHist2D: "<< h->GetName() << endl;
+#endif
+#ifdef TDR_STYLE_
+  CMS_lumi(c, 4, 10);
+#endif
+  c->RedrawAxis();
+  c->Update();
+  return c;
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 TCanvas* drawStackAndRatio(vector<TH1*> inhists, TH1* inData, TLegend *leg = 0, bool plotlog = false, TString ratioYTitle = "N_{obs}/N_{exp}", double lowY = RATIO_YMIN, double highY = RATIO_YMAX, double lowX = 0, double highX = -1, vector<TH1*> sighists={}, TGraphAsymmErrors* inUnc=nullptr, vector<TH1*> inRatios = {}, TGraphAsymmErrors* inRelUnc=nullptr)
 {
@@ -796,5 +976,94 @@ TCanvas* drawStackAndRatio(map<TString, vector<Quantity>> invec, vector<TString>
 
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+uint64_t hashAttributes(const TObject *obj, uint64_t h){
+  // line/fill/marker/text styles of any drawable object
+  if (auto *a = dynamic_cast<const TAttLine*>(obj)){
+    h = hashNumber(a->GetLineColor(), h); h = hashNumber(a->GetLineStyle(), h); h = hashNumber(a->GetLineWidth(), h);
+  }
+  if (auto *a = dynamic_cast<const TAttFill*>(obj)){
+    h = hashNumber(a->GetFillColor(), h); h = hashNumber(a->GetFillStyle(), h);
+  }
+  if (auto *a = dynamic_cast<const TAttMarker*>(obj)){
+    h = hashNumber(a->GetMarkerColor(), h); h = hashNumber(a->GetMarkerStyle(), h); h = hashNumber(a->GetMarkerSize(), h);
+  }
+  if (auto *a = dynamic_cast<const TAttText*>(obj)){
+    h = hashNumber(a->GetTextColor(), h); h = hashNumber(a->GetTextFont(), h); h = hashNumber(a->GetTextSize(), h); h = hashNumber(a->GetTextAlign(), h);
+  }
+  return h;
+}
+
+uint64_t hashAxis(const TAxis *ax, uint64_t h){
+  h = hashString(ax->GetTitle(), h);
+  h = hashNumber(ax->GetFirst(), h); h = hashNumber(ax->GetLast(), h);
+  h = hashNumber(ax->GetTitleSize(), h); h = hashNumber(ax->GetTitleOffset(), h);
+  h = hashNumber(ax->GetLabelSize(), h); h = hashNumber(ax->GetLabelOffset(), h);
+  h = hashNumber(ax->GetNdivisions(), h);
+  if (ax->GetLabels()){
+    for (int i=1; i<=ax->GetNbins(); ++i) h = hashString(ax->GetBinLabel(i), h);
+  }
+  return h;
+}
+
+uint64_t hashObject(const TObject *obj, TString drawOpt, uint64_t h){
+  // content hash of one primitive: everything that changes the rendered output
+  h = hashString(obj->ClassName(), h);
+  h = hashString(obj->GetTitle(), h);
+  h = hashString(drawOpt, h);
+  h = hashAttributes(obj, h);
+
+  if (auto *p = dynamic_cast<const TPad*>(obj)){
+    h = hashNumber(p->GetXlowNDC(), h); h = hashNumber(p->GetYlowNDC(), h); h = hashNumber(p->GetWNDC(), h); h = hashNumber(p->GetHNDC(), h);
+    h = hashNumber(p->GetLeftMargin(), h); h = hashNumber(p->GetRightMargin(), h); h = hashNumber(p->GetTopMargin(), h); h = hashNumber(p->GetBottomMargin(), h);
+    h = hashNumber(p->GetLogx(), h); h = hashNumber(p->GetLogy(), h); h = hashNumber(p->GetLogz(), h);
+    h = hashNumber(p->GetGridx(), h); h = hashNumber(p->GetGridy(), h);
+    TIter next(p->GetListOfPrimitives());
+    while (TObject *o = next()) h = hashObject(o, next.GetOption(), h);
+  }else if (auto *hist = dynamic_cast<const TH1*>(obj)){
+    h = hashNumber(hist->GetMinimum(), h); h = hashNumber(hist->GetMaximum(), h);
+    h = hashAxis(hist->GetXaxis(), h); h = hashAxis(hist->GetYaxis(), h); h = hashAxis(hist->GetZaxis(), h);
+    for (int i=0; i<hist->GetNcells(); ++i){
+      h = hashNumber(hist->GetBinContent(i), h);
+      h = hashNumber(hist->GetBinError(i), h);
+    }
+    for (int i=0; i<=hist->GetNbinsX(); ++i) h = hashNumber(hist->GetXaxis()->GetBinUpEdge(i), h);
+  }else if (auto *stack = dynamic_cast<const THStack*>(obj)){
+    if (stack->GetHists()){
+      TIter next(stack->GetHists());
+      while (TObject *o = next()) h = hashObject(o, next.GetOption(), h);
+    }
+  }else if (auto *gr = dynamic_cast<const TGraph*>(obj)){
+    for (int i=0; i<gr->GetN(); ++i){
+      h = hashNumber(gr->GetX()[i], h); h = hashNumber(gr->GetY()[i], h);
+      h = hashNumber(gr->GetErrorXlow(i), h); h = hashNumber(gr->GetErrorXhigh(i), h);
+      h = hashNumber(gr->GetErrorYlow(i), h); h = hashNumber(gr->GetErrorYhigh(i), h);
+    }
+  }else if (auto *leg = dynamic_cast<const TLegend*>(obj)){
+    h = hashNumber(leg->GetX1NDC(), h); h = hashNumber(leg->GetY1NDC(), h); h = hashNumber(leg->GetX2NDC(), h); h = hashNumber(leg->GetY2NDC(), h);
+    h = hashNumber(leg->GetNColumns(), h);
+    TIter next(leg->GetListOfPrimitives());
+    while (TObject *o = next()){
+      auto *entry = dynamic_cast<TLegendEntry*>(o);
+      if (!entry) continue;
+      h = hashString(entry->GetLabel(), h);
+      h = hashString(entry->GetOption(), h);
+      if (entry->GetObject()) h = hashAttributes(entry->GetObject(), h);
+    }
+  }else if (auto *text = dynamic_cast<const TText*>(obj)){
+    h = hashNumber(text->GetX(), h); h = hashNumber(text->GetY(), h);
+    h = hashNumber(text->GetNDC(), h);
+  }else if (auto *line = dynamic_cast<const TLine*>(obj)){
+    h = hashNumber(line->GetX1(), h); h = hashNumber(line->GetY1(), h); h = hashNumber(line->GetX2(), h); h = hashNumber(line->GetY2(), h);
+  }
+  return h;
+}
+
+std::string hashCanvas(TCanvas *c){
+  // fingerprint of everything drawn on the canvas (histograms, graphs, legends, labels, styles, draw options)
+  c->Update();
+  return hashToString(hashObject(c, "", HASH_SEED));
+}
+
 }
 #endif /*ESTTOOLS_ESTHELPER_HH_*/
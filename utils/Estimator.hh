@@ -3,20 +3,39 @@
 
 #if !defined(__CINT__) || defined(__MAKECINT__)
 
+#include "Threading.hh"
 #include "EstHelper.hh"
+#include "HistBooker.hh"
+#include "CategoryMasker.hh"
+#include "SkimWriter.hh"
+#include "ColumnStore.hh"
+#include "YieldSnapshot.hh"
+#include "YieldCache.hh"
+#include "SampleRegistry.hh"
 #include <thread>
+#include <typeinfo>
+#include <future>
 #include <mutex>
 #include <atomic>
 #include <math.h>
 
-#define ESTTOOLS_MULTITHREAD
-
 using namespace std;
 using json = nlohmann::json;
 #endif
 
 namespace EstTools{
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+TH1D* getHist(const Sample &sample, TString plotvar, TString sel, TString hname, TString title, std::vector<double> xbins){
+  // getHist() on the sample tree with the sample weight, including the per-file weights of multi-file samples
+  if (!sample.isMultiFile()) return getHist(sample.tree, plotvar, sample.wgtvar, sel, hname, title, xbins);
+  HistBooker booker(sample.tree, sample.wgtvar);
+  booker.setTreeWeights(sample.fileWeights);
+  auto hist = booker.book(plotvar, sel, hname, title, xbins);
+  booker.fill();
+  return hist;
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 class IEstimator {
 public:
@@ -34,6 +53,7 @@ public:
   virtual ~IEstimator() {
 //    TH1::AddDirectory(kFALSE); // Detach the histograms from the file: problematic
     if (fout_) fout_->Close();
+    savePlotManifest();
   }
 
   void setHeader(const TString& header) {
@@ -70,9 +90,60 @@ public:
     this->config = config;
   }
 
+  void setIncrementalPlots(bool incremental = true) {
+    // skip rendering canvases unchanged since the last run; hashCanvas only knows the primitives drawn by
+    // this package (histograms, stacks, graphs, legends, text, lines), so this is off by default
+    incrementalPlots_ = incremental;
+  }
+
+  void setReadAhead(Long64_t maxBytes) {
+    // bytes of the next sample read ahead by doYieldsCalc while the current one is processed (0: off, default)
+    // the baskets are read and decompressed once more and then dropped with the file, so this only helps when
+    // the page cache of a slow (network-mounted) filesystem is the bottleneck; remote (root://...) files are not
+    // read ahead, they are copied by the FileCache prefetch instead (if enabled)
+    readAheadBytes_ = maxBytes;
+  }
+
 public:
   void savePlot(TCanvas *c, TString fn){
-    c->SaveAs(outputdir_+"/"+fn+"."+config.plotFormat);
+    // with incremental plots (setIncrementalPlots), a canvas whose content hash matches the manifest
+    // of the previous run (and whose output file still exists) is not rendered again
+    TString outname = fn+"."+config.plotFormat;
+    if (!incrementalPlots_){
+      c->SaveAs(outputdir_+"/"+outname);
+      return;
+    }
+    auto hash = hashCanvas(c);
+    if (isPlotUpToDate(outname, hash)){
+      cout << "... " << outname << " unchanged, skip rendering" << endl;
+      return;
+    }
+    c->SaveAs(outputdir_+"/"+outname);
+    updatePlotManifest(outname, hash);
+  }
+
+  bool isPlotUpToDate(const TString &outname, const std::string &hash){
+    loadPlotManifest();
+    auto it = plotManifest_.find(outname.Data());
+    if (it == plotManifest_.end() || it->second != hash) return false;
+    return !gSystem->AccessPathName(outputdir_+"/"+outname); // AccessPathName returns false if the file exists
+  }
+
+  void updatePlotManifest(const TString &outname, const std::string &hash){
+    // kept in memory, written by savePlotManifest (at the latest when the estimator is destroyed)
+    loadPlotManifest();
+    plotManifest_[outname.Data()] = hash;
+    plotManifestDirty_ = true;
+  }
+
+  void savePlotManifest(){
+    if (!plotManifestDirty_) return;
+    TString fname = outputdir_+"/"+plotManifestName_;
+    std::ofstream fout((fname+".part").Data());
+    fout << json(plotManifest_).dump(2);
+    fout.close();
+    gSystem->Rename(fname+".part", fname);
+    plotManifestDirty_ = false;
   }
 
   void saveHist(const TH1 *h, TString name = ""){
@@ -93,6 +164,30 @@ public:
   TString postfix_;
   TString selection_;
   bool    saveHists_ = false;
+  bool    incrementalPlots_ = false;
+  Long64_t readAheadBytes_ = 0;
+
+protected:
+  void loadPlotManifest(){
+    // plot file name -> content hash of the canvas, kept in the output directory
+    if (plotManifestLoaded_) return;
+    plotManifestLoaded_ = true;
+    std::ifstream fin((outputdir_+"/"+plotManifestName_).Data());
+    if (!fin.good()) return;
+    try{
+      json j;
+      fin >> j;
+      plotManifest_ = j.get<std::map<std::string, std::string>>();
+    }catch (const std::exception &e){
+      cerr << "[IEstimator] Ignoring unreadable plot manifest " << outputdir_+"/"+plotManifestName_ << ": " << e.what() << endl;
+      plotManifest_.clear();
+    }
+  }
+
+  TString plotManifestName_ = ".plot_manifest.json";
+  std::map<std::string, std::string> plotManifest_;
+  bool plotManifestLoaded_ = false;
+  bool plotManifestDirty_ = false;
 
 };
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
@@ -148,9 +243,23 @@ public:
     // use SR categories if no CR categories are defined OR sample name ends with "-sr"
     // otherwise use CR categories
     // IF sample name ends with "-sr-int", we want to integrate in tops/Ws like the CRs, so use CR categories
-    for (auto &sname : sample_names){
+    // pipeline: the files of sample k+1 are copied to the FileCache (if enabled) while sample k is computed,
+    // and with setReadAhead() its baskets are read ahead as well (up to readAheadBytes_)
+    std::future<Long64_t> readAhead;
+    for (unsigned isample=0; isample<sample_names.size(); ++isample){
+      const auto &sname = sample_names.at(isample);
       auto start = chrono::steady_clock::now();
 
+      if (readAhead.valid()) readAhead.get(); // at most one sample in flight
+      if (isample+1 < sample_names.size()){
+        const auto &next = config.samples.at(sample_names.at(isample+1));
+        for (unsigned i=0; i<next.nFiles(); ++i) FileCache::instance().prefetch(next.filePath(i));
+      }
+      if (readAheadBytes_>0 && isample+1 < sample_names.size()){
+        TString next = sample_names.at(isample+1);
+        readAhead = std::async(std::launch::async, [this, next](){ return warmUpSample(next, readAheadBytes_); });
+      }
+
       cout << "\nCalc yields for sample " << sname << endl;
       const auto &sample = config.samples.at(sname);
       auto catMaps = (config.crCatMaps.empty() || sname.EndsWith("-sr")) ? config.catMaps : config.crCatMaps;
@@ -161,42 +270,74 @@ public:
       std::unordered_map<std::string, vector<Quantity>> results;
       std::mutex results_mutex;
 
+      auto cellCut = [&] (const TString &cat_name) {
+        return sampleCut(sname, config.sel + " && " + catMaps.at(cat_name).cut) + sample.sel;
+      };
+
+      // one job per category; a multi-file sample gets one job per file instead, which fills all
+      // categories in a single pass over the file, and the files are summed with their weights
+      // cells already in the YieldCache (this process, or earlier runs with YieldCache::enable) are not recomputed
+      bool perFile = sample.isMultiFile() && nBootstrapping==0;
+      std::string inputId = (!perFile && nBootstrapping==0 && YieldCache::instance().active()) ?
+                            YieldCache::inputIdentity(sample) : std::string();
+      TString errors;
       auto calcOne = [&] (TString cat_name) {
         ++nRunning;
-        const auto & cat = catMaps.at(cat_name);
-        auto cut = config.sel + " && " + cat.cut;
-        if(sname.Contains("singlelep")){
-          cut.ReplaceAll("_JESUp", "");
-          cut.ReplaceAll("_JESDown", "");
-          cut.ReplaceAll("_METUnClustUp", "");
-          cut.ReplaceAll("_METUnClustDown", "");
-        }
-        auto v = getYieldVectorWrapper(sample, cut + sample.sel, cat.bin, nBootstrapping);
-        if (v.size()<srCatMaps.at(cat_name).bin.nbins){
-          // !! FIXME : if cr bin numbers < sr: repeat the last bin
-          vector<Quantity> vv(v);
-          for (unsigned ibin=v.size(); ibin<srCatMaps.at(cat_name).bin.nbins; ++ibin){
-            vv.push_back(v.back());
-          }
-          v = vv;
-        }
+        auto v = cachedYieldVector(sample, cellCut(cat_name), catMaps.at(cat_name).bin, nBootstrapping, inputId);
         std::lock_guard<std::mutex> guard(results_mutex);
         results[cat_name.Data()] = v;
         --nRunning;
       };
+      auto calcFile = [&] (unsigned ifile) {
+        ++nRunning;
+        try{
+          auto cells = cachedFileYields(sample.fileSample(ifile), config.categories, cellCut, catMaps);
+          std::lock_guard<std::mutex> guard(results_mutex);
+          for (const auto &c : cells){
+            auto v = c.second * sample.fileWeight(ifile);
+            auto &r = results[c.first.Data()];
+            r = r.empty() ? v : r + v;
+          }
+        }catch (const std::exception &e){
+          std::lock_guard<std::mutex> guard(results_mutex);
+          errors += TString(e.what()) + "\n";
+        }
+        --nRunning;
+      };
 
 #ifdef ESTTOOLS_MULTITHREAD
       std::vector<std::thread> pool;
-      for (auto &cat_name : config.categories){
-        while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
-        pool.emplace_back(calcOne, cat_name);
+      if (perFile){
+        for (unsigned ifile=0; ifile<sample.nFiles(); ++ifile){
+          while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
+          pool.emplace_back(calcFile, ifile);
+        }
+      }else{
+        for (auto &cat_name : config.categories){
+          while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
+          pool.emplace_back(calcOne, cat_name);
+        }
       }
       for (auto && t : pool) t.join();
 #else
-      for (auto &cat_name : config.categories){
-        calcOne(cat_name);
+      if (perFile){
+        for (unsigned ifile=0; ifile<sample.nFiles(); ++ifile) calcFile(ifile);
+      }else{
+        for (auto &cat_name : config.categories) calcOne(cat_name);
       }
 #endif
+      if (errors != "") throw std::runtime_error(("BaseEstimator::doYieldsCalc: " + sname + "\n" + errors).Data());
+      for (auto &cat_name : config.categories){
+        auto &v = results.at(cat_name.Data());
+        if (v.size()<srCatMaps.at(cat_name).bin.nbins){
+          // !! FIXME : if cr bin numbers < sr: repeat the last bin
+          vector<Quantity> vv(v);
+          for (unsigned ibin=v.size(); ibin<srCatMaps.at(cat_name).bin.nbins; ++ibin){
+            vv.push_back(v.back());
+          }
+          v = vv;
+        }
+      }
       yields[sname] = vector<Quantity>();
       for (auto &cat_name : config.categories){
         yields[sname].insert(yields[sname].end(), results.at(cat_name.Data()).begin(), results.at(cat_name.Data()).end());
@@ -208,9 +349,123 @@ public:
     }
   }
 
+  Long64_t warmUpSample(const TString &sname, Long64_t maxBytes){
+    // read the baskets of the branches the yields of the sample need, for its local files only: a remote file would
+    // block on the FileCache download prefetch() already runs, or (without the cache) be read and thrown away
+    auto start = chrono::steady_clock::now();
+    const auto &sample = config.samples.at(sname);
+    vector<TString> exprs = {config.sel + sample.sel, sample.wgtvar};
+    for (const auto &cat : indexCategories(sname)){
+      exprs.push_back(cat.cut);
+      exprs.push_back(cat.bin.var);
+    }
+    Long64_t bytes = 0;
+    for (unsigned i=0; i<sample.nFiles() && bytes<maxBytes; ++i){
+      if (FileCache::isRemote(sample.filePath(i))) continue;
+      TDirectory::TContext ctxt;
+      std::unique_ptr<TFile> infile(TFile::Open(sample.filePath(i)));
+      if (!infile || infile->IsZombie()) continue;
+      TTree *intree = nullptr;
+      infile->GetObject(sample.treename, intree);
+      if (!intree) continue;
+      bytes += warmUpTree(intree, getReferencedBranches(intree, exprs), maxBytes - bytes);
+    }
+#ifdef DEBUG_
+    cerr << sname << ": read ahead " << bytes/(1024.*1024) << " MB in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+#endif
+    return bytes;
+  }
+
+  vector<Quantity> cachedYieldVector(const Sample& sample, TString sel, const BinInfo &bin, int nBootstrapping=0,
+                                     std::string inputId=""){
+    // getYieldVectorWrapper memoized in the YieldCache, keyed by the estimator class, the input file identity and
+    // the canonical weight/selection/binning (bootstrapped yields are random and never cached)
+    // inputId: YieldCache::inputIdentity(sample) if the caller has it already, so it is not re-stat'ed per cell
+    // multi-file samples: the sum over their files, each cached on its own and scaled by its weight
+    if (sample.isMultiFile()){
+      vector<Quantity> sum;
+      for (unsigned i=0; i<sample.nFiles(); ++i){
+        auto v = cachedYieldVector(sample.fileSample(i), sel, bin, nBootstrapping) * sample.fileWeight(i);
+        sum = sum.empty() ? v : sum + v;
+      }
+      return sum;
+    }
+    auto &cache = YieldCache::instance();
+    if (nBootstrapping!=0 || !cache.active()) return getYieldVectorWrapper(sample, sel, bin, nBootstrapping);
+    if (inputId=="") inputId = YieldCache::inputIdentity(sample);
+    auto key = YieldCache::key(sample, inputId, sel, bin, typeid(*this).name());
+    if (key=="") return getYieldVectorWrapper(sample, sel, bin, nBootstrapping);
+    vector<Quantity> v;
+    if (cache.get(key, v)){
+#ifdef DEBUG_
+      cerr << sample.name << ": cached yields " << key << endl;
+#endif
+      return v;
+    }
+    v = getYieldVectorWrapper(sample, sel, bin, nBootstrapping);
+    cache.put(key, v);
+    return v;
+  }
+
+  map<TString, vector<Quantity>> cachedFileYields(const Sample &sample, const vector<TString> &cat_names,
+                                                  const std::function<TString(const TString&)> &cellCut, const map<TString, Category> &catMaps){
+    // yields of all *cat_names* for a single-file sample, as the base getYieldVectorWrapper on the tree for each
+    // cellCut(cat), but the cells missing in the YieldCache are filled in one HistBooker pass over the file
+    auto &cache = YieldCache::instance();
+    map<TString, vector<Quantity>> result;
+    map<TString, std::string> keys;
+    vector<TString> missing;
+    auto inputId = cache.active() ? YieldCache::inputIdentity(sample) : std::string();
+    for (const auto &cat_name : cat_names){
+      auto key = YieldCache::key(sample, inputId, cellCut(cat_name), catMaps.at(cat_name).bin, "HistBooker");
+      vector<Quantity> v;
+      if (key!="" && cache.get(key, v)) result[cat_name] = v;
+      else {
+        keys[cat_name] = key;
+        missing.push_back(cat_name);
+      }
+    }
+    if (missing.empty()) return result;
+
+    TDirectory::TContext ctxt;
+    std::unique_ptr<TFile> infile(FileCache::instance().open(sample.filepath));
+    if (!infile || infile->IsZombie())
+      throw std::runtime_error(("BaseEstimator::cachedFileYields: cannot open " + sample.filepath).Data());
+    TTree *intree = nullptr;
+    infile->GetObject(sample.treename, intree);
+    if (!intree)
+      throw std::runtime_error(("BaseEstimator::cachedFileYields: no tree " + sample.treename + " in " + sample.filepath).Data());
+    intree->SetTitle(sample.name);
+
+    HistBooker booker(intree, sample.wgtvar);
+    map<TString, std::unique_ptr<TH1D>> hists;
+    for (const auto &cat_name : missing){
+      const auto &bin = catMaps.at(cat_name).bin;
+      auto *h = booker.book(bin.var, cellCut(cat_name), "hcell_"+sample.name+"_"+cat_name, "", bin.plotbins);
+      h->SetDirectory(nullptr);
+      hists[cat_name].reset(h);
+    }
+    booker.fill();
+    for (const auto &cat_name : missing){
+      auto *h = hists.at(cat_name).get();
+      addOverflow(h);
+      vector<Quantity> v;
+      for (unsigned i=0; i<catMaps.at(cat_name).bin.nbins; ++i) v.push_back(getHistBin(h, i+1));
+      if (keys.at(cat_name)!="") cache.put(keys.at(cat_name), v);
+      result[cat_name] = v;
+    }
+    return result;
+  }
+
   virtual vector<Quantity> getYieldVectorWrapper(const Sample& sample, TString sel, const BinInfo &bin, int nBootstrapping=0){
+    if (nBootstrapping==0 && sample.columndir!=""){
+      // zero-copy on the memory-mapped columns, if they hold the entries passing the current config.sel
+      auto store = ColumnStore::open(sample.columndir);
+      if (store->matches(config.sel)) return getYieldVector(*store, sample.wgtvar, sel, bin);
+    }
     if (nBootstrapping==0){
-      TFile *file = TFile::Open(sample.filepath);
+      TFile *file = FileCache::instance().open(sample.filepath);
       std::unique_ptr<TFile> infile(file);
       std::unique_ptr<TTree> intree(dynamic_cast<TTree*>(infile->Get(sample.treename)));
       intree->SetTitle(sample.name);
@@ -223,6 +478,228 @@ public:
     }
   }
 
+  static TString sampleCut(const TString &sname, TString cut) {
+    // the singlelep samples have no JES/MET variations, their cuts use the nominal variables
+    if(sname.Contains("singlelep")){
+      cut.ReplaceAll("_JESUp", "");
+      cut.ReplaceAll("_JESDown", "");
+      cut.ReplaceAll("_METUnClustUp", "");
+      cut.ReplaceAll("_METUnClustDown", "");
+    }
+    return cut;
+  }
+
+  vector<Category> indexCategories(const TString &sname) const {
+    // categories in the order of config.categories, SR or CR as chosen in doYieldsCalc, with the cuts as applied to *sname*
+    const auto &catMaps = (config.crCatMaps.empty() || sname.EndsWith("-sr")) ? config.catMaps : config.crCatMaps;
+    vector<Category> cats;
+    for (const auto &cat_name : config.categories){
+      auto cat = catMaps.at(cat_name);
+      cat.cut = sampleCut(sname, cat.cut);
+      cats.push_back(cat);
+    }
+    return cats;
+  }
+
+  void buildCategoryIndex(const vector<TString> &sample_names, TString outdir = ""){
+    // compute the category bits and yields-bin index of every event once per sample, store them as a friend tree
+    // (CategoryIndexWriter) next to the sample, or in *outdir*, and attach it to sample.tree as "CatIndex"
+    // an existing friend tree is reused if it was made from the same categories and input tree
+    // the friend trees must go to a local directory: pass *outdir* for samples on EOS or xrootd
+    const int nMax = std::max(std::thread::hardware_concurrency()*0.8, std::thread::hardware_concurrency()-2.);
+    std::atomic<int> nRunning(0);
+    map<TString, TString> friendfiles;
+    std::mutex results_mutex;
+    TString errors;
+
+    for (auto &sname : sample_names){
+      const auto &sample = config.samples.at(sname);
+      if (sample.isMultiFile())
+        throw std::invalid_argument(("BaseEstimator::buildCategoryIndex: " + sname + " is a multi-file sample, use doYieldsCalc").Data());
+      TString dir = outdir=="" ? TString(gSystem->DirName(sample.filepath)) : outdir;
+      if (FileCache::isRemote(dir) || dir.BeginsWith("/eos/"))
+        throw std::invalid_argument(("BaseEstimator::buildCategoryIndex: cannot write the category index of " + sname + " to " + dir + ", pass a local outdir").Data());
+    }
+
+    auto buildOne = [&] (TString sname) {
+      ++nRunning;
+      try{
+        const auto &sample = config.samples.at(sname);
+        auto cats = indexCategories(sname);
+        TString friendfile = (outdir=="" ? TString(gSystem->DirName(sample.filepath)) : outdir) + "/"
+            + TString(gSystem->BaseName(sample.filepath)).ReplaceAll(".root", "") + "_catidx.root";
+
+        TDirectory::TContext ctxt;
+        std::unique_ptr<TFile> infile(FileCache::instance().open(sample.filepath));
+        if (!infile || infile->IsZombie())
+          throw std::invalid_argument(("BaseEstimator::buildCategoryIndex: cannot open " + sample.filepath).Data());
+        TTree *intree = nullptr;
+        infile->GetObject(sample.treename, intree);
+        if (!intree)
+          throw std::invalid_argument(("BaseEstimator::buildCategoryIndex: no tree " + sample.treename + " in " + sample.filepath).Data());
+        intree->SetTitle(sample.name);
+        auto hash = CategoryIndexWriter::categoryIndexHash(intree, sample.filepath, cats);
+        if (CategoryIndexWriter::isUpToDate(friendfile, hash)){
+          cout << sname << ": category index " << friendfile << " is up to date" << endl;
+        }else{
+          CategoryIndexWriter writer(intree, cats, friendfile, hash);
+          writer.write();
+          cout << sname << ": wrote category index " << friendfile << endl;
+          if (!writer.overlaps().empty())
+            cerr << "!!! " << sname << ": categories overlap, binIndex holds the first matching category only" << endl;
+        }
+        std::lock_guard<std::mutex> guard(results_mutex);
+        friendfiles[sname] = friendfile;
+      }catch (const std::exception &e){
+        std::lock_guard<std::mutex> guard(results_mutex);
+        errors += sname + ": " + e.what() + "\n";
+      }
+      --nRunning;
+    };
+
+#ifdef ESTTOOLS_MULTITHREAD
+    std::vector<std::thread> pool;
+    for (auto &sname : sample_names){
+      while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
+      pool.emplace_back(buildOne, sname);
+    }
+    for (auto && t : pool) t.join();
+#else
+    for (auto &sname : sample_names){
+      buildOne(sname);
+    }
+#endif
+    if (errors != "") throw std::runtime_error(errors.Data());
+
+    for (auto &sname : sample_names){
+      auto &sample = config.samples.at(sname);
+      if (!sample.tree->GetFriend(CategoryIndexWriter::TREE_NAME))
+        sample.tree->AddFriend(CategoryIndexWriter::TREE_NAME, friendfiles.at(sname));
+    }
+  }
+
+  TString categoryIndexCut(const TString &cat_name) const {
+    // integer lookup replacing the category cut (needs buildCategoryIndex on the samples used)
+    int icat = std::find(config.categories.begin(), config.categories.end(), cat_name) - config.categories.begin();
+    if (icat == (int)config.categories.size())
+      throw std::invalid_argument(("BaseEstimator::categoryIndexCut: unknown category " + cat_name).Data());
+    return TString::Format("((CatIndex.catBits[%d]>>%d)&1)", icat/32, icat%32);
+  }
+
+  void calcYieldsFromIndex(const vector<TString> &sample_names){
+    // same as doYieldsCalc, but all bins of a sample come from a single histogram of CatIndex.binIndex
+    // needs buildCategoryIndex on the samples, and orthogonal categories
+    for (auto &sname : sample_names){
+      auto start = chrono::steady_clock::now();
+      cout << "\nCalc yields from the category index for sample " << sname << endl;
+      const auto &sample = config.samples.at(sname);
+      if (!sample.tree->GetFriend(CategoryIndexWriter::TREE_NAME))
+        throw std::invalid_argument(("BaseEstimator::calcYieldsFromIndex: no category index for " + sname + ", run buildCategoryIndex first").Data());
+
+      unsigned nbins = 0;
+      for (const auto &cat : indexCategories(sname)) nbins += cat.bin.nbins;
+      if (nbins != config.nbins())
+        throw std::invalid_argument(("BaseEstimator::calcYieldsFromIndex: CR binning of " + sname + " differs from the SR binning, use doYieldsCalc").Data());
+      HistBooker booker(sample.tree, sample.wgtvar, sampleCut(sname, config.sel) + sample.sel);
+      booker.setTreeWeights(sample.fileWeights);
+      auto hist = booker.book("CatIndex.binIndex", "", "catidx_" + sname + "_" + postfix_, "", nbins, -0.5, nbins-0.5);
+      booker.fill();
+      yields[sname] = vector<Quantity>();
+      for (unsigned ibin=0; ibin<nbins; ++ibin) yields[sname].push_back(getHistBin(hist, ibin+1));
+      delete hist;
+
+      auto end = chrono::steady_clock::now();
+      cout << chrono::duration <double, milli> (end - start).count() << " ms" << endl;
+    }
+  }
+
+  map<TString, vector<TString>> fileExpressions(const vector<BinInfo> &plotvars = {}, const vector<TString> &sample_names = {}) const {
+    // input file (Sample::fname) -> every expression the configuration evaluates on it: config.sel and the sample
+    // selections, weights, all SR/CR category and bin cuts, and *plotvars* (all samples if *sample_names* is empty)
+    map<TString, vector<TString>> fileExprs;
+    for (const auto &s : config.samples){
+      if (!sample_names.empty() && std::find(sample_names.begin(), sample_names.end(), s.first) == sample_names.end()) continue;
+      const auto &sample = s.second;
+      if (sample.isMultiFile()) continue; // read from the original files only (no skims or column stores)
+      auto &exprs = fileExprs[sample.fname];
+      exprs.push_back(config.sel + sample.sel);
+      exprs.push_back(sample.wgtvar);
+      for (const auto *catMaps : {&config.catMaps, &config.crCatMaps}){
+        for (const auto &c : *catMaps){
+          exprs.push_back(c.second.cut);
+          exprs.push_back(c.second.bin.var);
+          for (const auto &bcut : c.second.bin.cuts) exprs.push_back(bcut);
+        }
+      }
+      for (const auto &v : plotvars) exprs.push_back(v.var);
+    }
+    return fileExprs;
+  }
+
+  template<typename Func>
+  void runPerFile(const map<TString, vector<TString>> &fileExprs, Func func) const {
+    // func(fname, exprs) for every input file, in a thread pool; throws after all files if any of them failed
+    const int nMax = std::max(std::thread::hardware_concurrency()*0.8, std::thread::hardware_concurrency()-2.);
+    std::atomic<int> nRunning(0);
+    std::mutex errors_mutex;
+    TString errors;
+    auto runOne = [&] (TString fname) {
+      ++nRunning;
+      try{
+        func(fname, fileExprs.at(fname));
+      }catch (const std::exception &e){
+        std::lock_guard<std::mutex> guard(errors_mutex);
+        errors += fname + ": " + e.what() + "\n";
+      }
+      --nRunning;
+    };
+
+#ifdef ESTTOOLS_MULTITHREAD
+    std::vector<std::thread> pool;
+    for (const auto &f : fileExprs){
+      while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
+      pool.emplace_back(runOne, f.first);
+    }
+    for (auto && t : pool) t.join();
+#else
+    for (const auto &f : fileExprs){
+      runOne(f.first);
+    }
+#endif
+    if (errors != "") throw std::runtime_error(errors.Data());
+  }
+
+  void skimSamples(TString skimdir, const vector<BinInfo> &plotvars = {}, const vector<TString> &sample_names = {}){
+    // write a slim skim of every input file to *skimdir*, keeping the events passing config.sel
+    // and the branches read by fileExpressions(plotvars, sample_names)
+    // set config.skimdir = skimdir (before addSample) to use them
+    const TString treename = Sample().treename;
+    runPerFile(fileExpressions(plotvars, sample_names), [&](TString fname, const vector<TString> &exprs){
+      // always from inputdir, never the skim itself
+      writeSkim(config.inputdir+"/"+fname+"_tree.root", treename, skimdir+"/"+fname+"_tree.root", exprs, config.sel);
+    });
+  }
+
+  void writeColumnStores(TString columndir, const vector<BinInfo> &plotvars = {}, const vector<TString> &sample_names = {}){
+    // write a memory-mapped column store (ColumnStore.hh) of every input file to *columndir*/<fname>, with the entries
+    // passing config.sel and one column per expression (selection term) of fileExpressions(plotvars, sample_names)
+    // set config.columndir = columndir (before addSample) to use them for the yields
+    map<TString, TString> inputs;
+    for (const auto &s : config.samples) inputs[s.second.fname] = s.second.filepath;
+    runPerFile(fileExpressions(plotvars, sample_names), [&](TString fname, const vector<TString> &exprs){
+      TDirectory::TContext ctxt;
+      std::unique_ptr<TFile> infile(FileCache::instance().open(inputs.at(fname)));
+      if (!infile || infile->IsZombie())
+        throw std::invalid_argument(("BaseEstimator::writeColumnStores: cannot open " + inputs.at(fname)).Data());
+      TTree *intree = nullptr;
+      infile->GetObject(Sample().treename, intree);
+      if (!intree)
+        throw std::invalid_argument(("BaseEstimator::writeColumnStores: no tree in " + inputs.at(fname)).Data());
+      intree->SetTitle(fname);
+      writeColumnStore(intree, columndir+"/"+fname, exprs, config.sel);
+    });
+  }
+
   void sumYields(vector<TString> list, TString sum_name){
     // sum yields from samples in the list, and store as "sum_name"
     assert(list.size() <= yields.size());
@@ -521,7 +998,7 @@ public:
 
     const auto &samp = config.samples.at(sample);
     auto hname = filterString(plotvar) + "_" + sample + "_" + category.name + "_" + postfix_;
-    auto hist = getHist(samp.tree, plotvar, samp.wgtvar, cut + samp.sel, hname, title, var_info.plotbins);
+    auto hist = getHist(samp, plotvar, cut + samp.sel, hname, title, var_info.plotbins);
     prepHists({hist});
     if (saveHists_) saveHist(hist);
 
@@ -545,11 +1022,22 @@ public:
       TH1* hRef = nullptr;
       auto sname = comp_samples.at(isamp);
       const auto& sample = config.samples.at(sname);
-      for (unsigned icat=0; icat<comp_categories.size(); ++icat){
-        auto cat = config.catMaps.at(comp_categories.at(icat));
+
+      // fill all compared categories of this sample in one event loop
+      auto presel = config.sel + sample.sel + TString(selection_=="" ? "" : " && "+selection_);
+      HistBooker booker(sample.tree, sample.wgtvar, presel);
+      booker.setTreeWeights(sample.fileWeights);
+      vector<TH1*> cathists;
+      for (const auto &cat_name : comp_categories){
+        const auto &cat = config.catMaps.at(cat_name);
         auto hname = filterString(plotvar) + "_" + sname + "_" + cat.name + "_" + postfix_;
-        auto cut = config.sel + sample.sel + " && " + cat.cut + TString(selection_=="" ? "" : " && "+selection_);
-        auto htmp = getHist(sample.tree, plotvar, sample.wgtvar, cut, hname, title, var_info.plotbins);
+        cathists.push_back(booker.book(plotvar, cat.cut, hname, title, var_info.plotbins));
+      }
+      booker.fill();
+
+      for (unsigned icat=0; icat<comp_categories.size(); ++icat){
+        const auto &cat = config.catMaps.at(comp_categories.at(icat));
+        auto htmp = cathists.at(icat);
         htmp->SetLineStyle(icat+1);
         prepHists({htmp}, isNormalized);
         if (saveHists_) saveHist(htmp);
@@ -621,8 +1109,8 @@ public:
       const auto& sample = config.samples.at(sname);
       auto hname = num_var + "_over_" + denom_var + "_" + sname + "_" + postfix_;
       auto cut = config.sel + TString(selection_=="" ? "" : " && "+selection_);
-      auto hnum = getHist(sample.tree, num_var, sample.wgtvar, cut + sample.sel, hname, title, num.plotbins);
-      auto hdenom = getHist(sample.tree, denom_var, sample.wgtvar, cut + sample.sel, hname+"_denom", title, num.plotbins);
+      auto hnum = getHist(sample, num_var, cut + sample.sel, hname, title, num.plotbins);
+      auto hdenom = getHist(sample, denom_var, cut + sample.sel, hname+"_denom", title, num.plotbins);
       prepHists({hnum, hdenom});
       hnum->Divide(hnum, hdenom, 1, 1, "B");
       if (comp_samples.size()==2){
@@ -673,7 +1161,7 @@ public:
     for (const auto &sname : mc_samples){
       const auto& sample = config.samples.at(sname);
       auto hname = filterString(plotvar) + "_" + sname + "_" + category.name + "_" + postfix_;
-      auto hist = getHist(sample.tree, plotvar, sample.wgtvar, cut + sample.sel, hname, title, var_info.plotbins);
+      auto hist = getHist(sample, plotvar, cut + sample.sel, hname, title, var_info.plotbins);
       prepHists({hist}, false, true, true);
       if (saveHists_) saveHist(hist);
       mchists.push_back(hist);
@@ -691,7 +1179,7 @@ public:
     for (const auto &sname : signal_samples){
       const auto& sample = config.samples.at(sname);
       auto hname = filterString(plotvar) + "_" + sname + "_" + category.name + "_" + postfix_;
-      auto hist = getHist(sample.tree, plotvar, sample.wgtvar, cut + sample.sel, hname, title, var_info.plotbins);
+      auto hist = getHist(sample, plotvar, cut + sample.sel, hname, title, var_info.plotbins);
       prepHists({hist});
       if (saveHists_) saveHist(hist);
       sighists.push_back(hist);
@@ -718,18 +1206,36 @@ public:
     // make BKG vs Signal plots with the given cateogory selection
     // plot S/sqrt(B) in the lower pad
 
-    vector<TH1*> mchists, sighists, sigmahists;
-    TH1 *bkgtotal = nullptr;
-    auto leg = initLegend();
-
     TString plotvar = var_info.var;
     TString title = ";"
         + var_info.label + (var_info.unit=="" ? "" : " ["+var_info.unit + "]") +";"
         + "Events";
-    TString RYTitle = "S/#sqrt{B}";
 
     auto cut = config.sel + " && " + category.cut + TString(selection_=="" ? "" : " && "+selection_);
 
+    map<TString, TH1*> hists;
+    vector<TString> snames(mc_samples);
+    snames.insert(snames.end(), sig_sample.begin(), sig_sample.end());
+    for (const auto &sname : snames){
+      const auto& sample = config.samples.at(sname);
+      auto hname = filterString(plotvar) + "_" + sname + "_" + category.name + "_" + postfix_;
+      hists[sname] = getHist(sample, plotvar, cut + sample.sel, hname, title, var_info.plotbins);
+    }
+
+    drawSigVsBkg(var_info, hists, mc_samples, sig_sample, category, showSigma, plotlog, normalize, plotextra, inRatio, scale, hName);
+  }
+
+  void drawSigVsBkg(const BinInfo& var_info, const map<TString, TH1*>& hists, const vector<TString>& mc_samples, const vector<TString>& sig_sample, const Category& category, bool showSigma = true,  bool plotlog = false, bool normalize = false, std::function<void(TCanvas*)> *plotextra = nullptr, bool inRatio = true, float scale = -1., TString hName = ""){
+    // draw BKG vs Signal from already filled histograms (*hists*: sample name -> histogram in var_info binning)
+    // the signal histograms are scaled in place
+
+    vector<TH1*> mchists, sighists, sigmahists;
+    TH1 *bkgtotal = nullptr;
+    auto leg = initLegend();
+
+    TString plotvar = var_info.var;
+    TString RYTitle = "S/#sqrt{B}";
+
 
     vector<TString> mc;
     for(auto &scomb : mc_samples){
@@ -750,8 +1256,7 @@ public:
 	sMC = sMC.ReplaceAll("-cr","").ReplaceAll("-withveto","");
 	if(sMC == scomb){
           label = sample.label;
-          auto hname = filterString(plotvar) + "_" + sname + "_" + category.name + "_" + postfix_;
-          auto hmc_buff = getHist(sample.tree, plotvar, sample.wgtvar, cut + sample.sel, hname, title, var_info.plotbins);
+          auto hmc_buff = hists.at(sname);
 	  if(!hist) hist = (TH1*) hmc_buff->Clone();
 	  else      hist->Add(hmc_buff);
 	}
@@ -783,8 +1288,8 @@ public:
     int color = 0;
     for (auto &sname : sig_sample){
       const auto& sample = config.samples.at(sname);
-      auto hname = filterString(plotvar) + "_" + sname + "_" + category.name + "_" + postfix_;
-      auto hist = getHist(sample.tree, plotvar, sample.wgtvar, cut + sample.sel, hname, title, var_info.plotbins);
+      auto hist = hists.at(sname);
+      TString hname = hist->GetName();
       prepHists({hist});
       hist->SetLineStyle(kDashed);
       hist->SetLineWidth(3);
@@ -833,6 +1338,193 @@ public:
   }
 
 
+  map<TString, THnBase*> getSparseHists(const vector<BinInfo>& axes, const vector<TString>& samples, const Category& category, TString name = "sparse"){
+    // fill one sparse N-dim histogram per sample (one pass per sample), axes named after BinInfo::var
+    // slice/project them with projectSparse/projectSparse2D, or plot them with plotSparseSigVsBkg
+    auto cut = config.sel + " && " + category.cut + TString(selection_=="" ? "" : " && "+selection_);
+    map<TString, THnBase*> hists;
+    for (const auto &sname : samples){
+      const auto& sample = config.samples.at(sname);
+      HistBooker booker(sample.tree, sample.wgtvar);
+      booker.setTreeWeights(sample.fileWeights);
+      hists[sname] = booker.bookSparse(axes, cut + sample.sel, name + "_" + sname + "_" + category.name + "_" + postfix_);
+      booker.fill();
+    }
+    return hists;
+  }
+
+  void plotSparseSigVsBkg(const vector<BinInfo>& axes, const map<TString, THnBase*>& sparse, const vector<TString>& mc_samples, const vector<TString>& sig_sample, const Category& category, const map<int, pair<double, double>> &slices = {}, bool showSigma = true,  bool plotlog = false, bool normalize = false, std::function<void(TCanvas*)> *plotextra = nullptr){
+    // plotSigVsBkg for every axis of the sparse histograms (optionally sliced), without reading the trees again
+    for (const auto &var_info : axes){
+      map<TString, TH1*> hists;
+      for (const auto &sp : sparse){
+        int iaxis = findSparseAxis(sp.second, var_info.var);
+        if (slices.count(iaxis)) continue; // a sliced axis is a selection, not a plot
+        auto hname = filterString(var_info.var) + "_" + sp.first + "_" + category.name + "_" + postfix_;
+        hists[sp.first] = projectSparse(sp.second, iaxis, hname, slices);
+      }
+      if (hists.empty()) continue;
+      drawSigVsBkg(var_info, hists, mc_samples, sig_sample, category, showSigma, plotlog, normalize, plotextra);
+    }
+  }
+
+  void plotSigVsBkg2D(const BinInfo& xvar, const BinInfo& yvar, const vector<TString>& mc_samples, const vector<TString>& sig_sample, const vector<TString>& categories, const vector<BinInfo>& vars1D = {}, bool plotlog = false, std::function<void(TCanvas*)> *plotextra = nullptr){
+    // 2D BKG vs Signal in *categories* (names in config.catMaps): total background, each signal,
+    // and the S/B and S/sqrt(B) maps of each signal
+    // the 1D plotSigVsBkg plots of *vars1D* are filled in the same pass (one event loop per sample)
+    // (the axis titles of the 2D histograms come from HistBooker::book2D)
+
+    TString name2D = filterString(yvar.var) + "_vs_" + filterString(xvar.var);
+
+    vector<TString> snames(mc_samples);
+    snames.insert(snames.end(), sig_sample.begin(), sig_sample.end());
+
+    map<TString, map<TString, TH2*>> hists2D;             // category -> sample -> 2D
+    map<TString, map<TString, map<TString, TH1*>>> hists1D; // category -> var -> sample -> 1D
+    auto presel = config.sel + TString(selection_=="" ? "" : " && "+selection_);
+    for (const auto &sname : snames){
+      const auto& sample = config.samples.at(sname);
+      HistBooker booker(sample.tree, sample.wgtvar, presel + sample.sel);
+      booker.setTreeWeights(sample.fileWeights);
+      for (const auto &cat_name : categories){
+        const auto &cat = config.catMaps.at(cat_name);
+        hists2D[cat_name][sname] = booker.book2D(xvar, yvar, cat.cut, name2D + "_" + sname + "_" + cat.name + "_" + postfix_);
+        for (const auto &var_info : vars1D){
+          TString title1D = ";" + var_info.label + (var_info.unit=="" ? "" : " ["+var_info.unit+"]") + ";Events";
+          auto hname = filterString(var_info.var) + "_" + sname + "_" + cat.name + "_" + postfix_;
+          hists1D[cat_name][var_info.var][sname] = booker.book(var_info.var, cat.cut, hname, title1D, var_info.plotbins);
+        }
+      }
+      booker.fill();
+    }
+
+    TString axis = plotlog ? "_log" : "_linear";
+    for (const auto &cat_name : categories){
+      const auto &cat = config.catMaps.at(cat_name);
+      const auto &h2 = hists2D.at(cat_name);
+
+      TH2 *bkgtotal = nullptr;
+      for (const auto &sname : mc_samples){
+        if (!bkgtotal) bkgtotal = (TH2*)h2.at(sname)->Clone(name2D + "_bkgtotal_" + cat.name + "_" + postfix_);
+        else           bkgtotal->Add(h2.at(sname));
+      }
+
+      auto draw = [&](TH2 *h, TString plotname, bool logz){
+        if (saveHists_) saveHist(h);
+        auto c = drawHist2D(h, logz);
+        if (plotextra) (*plotextra)(c);
+        c->SetTitle(plotname);
+        savePlot(c, plotname);
+      };
+
+      draw(bkgtotal, name2D + "_bkgtotal_" + cat.name + axis + "__" + postfix_, plotlog);
+      for (const auto &sname : sig_sample){
+        auto hsig = h2.at(sname);
+        draw(hsig, name2D + "_" + sname + "_" + cat.name + axis + "__" + postfix_, plotlog);
+        draw(makeSigBkgMap(hsig, bkgtotal), name2D + "_" + sname + "_SoverB_" + cat.name + "__" + postfix_, false);
+        draw(makeSigBkgMap(hsig, bkgtotal, true), name2D + "_" + sname + "_SoverSqrtB_" + cat.name + "__" + postfix_, false);
+      }
+
+      for (const auto &var_info : vars1D){
+        drawSigVsBkg(var_info, hists1D.at(cat_name).at(var_info.var), mc_samples, sig_sample, cat, true, plotlog, false, plotextra);
+      }
+    }
+  }
+
+  struct CutScanPoint{
+    double    cut;        // threshold (var > cut, or var < cut)
+    Quantity  sig;        // total signal passing
+    Quantity  bkg;        // total background passing
+    double    sOverSqrtB;
+    double    asimovZ;
+    double    sOverB;
+  };
+
+  map<TString, vector<CutScanPoint>> scanCuts(const vector<BinInfo>& vars, const vector<TString>& mc_samples, const vector<TString>& sig_sample, const Category& category, bool useGreaterThan = true, std::function<void(TCanvas*)> *plotextra = nullptr){
+    // scan a one-sided cut on each of *vars* on top of the category selection, every edge of var_info.plotbins is a
+    // threshold (so use a fine binning); all signal samples are summed
+    // histograms of all variables are filled in one event loop per sample and integrated with getIntegratedHist
+    // prints the table, plots S/sqrt(B) and the Asimov Z with S/B in the ratio pad, and returns var -> scan points
+
+    auto cut = config.sel + " && " + category.cut + TString(selection_=="" ? "" : " && "+selection_);
+    TString dir = useGreaterThan ? "gt" : "lt";
+
+    vector<TString> snames(mc_samples);
+    snames.insert(snames.end(), sig_sample.begin(), sig_sample.end());
+
+    map<TString, map<TString, TH1*>> hists; // var -> sample -> hist
+    for (const auto &sname : snames){
+      const auto& sample = config.samples.at(sname);
+      HistBooker booker(sample.tree, sample.wgtvar, cut + sample.sel);
+      booker.setTreeWeights(sample.fileWeights);
+      for (const auto &var_info : vars){
+        auto hname = filterString(var_info.var) + "_scan_" + sname + "_" + category.name + "_" + postfix_;
+        hists[var_info.var][sname] = booker.book(var_info.var, "", hname, "", var_info.plotbins);
+      }
+      booker.fill();
+    }
+
+    map<TString, vector<CutScanPoint>> results;
+    for (const auto &var_info : vars){
+      auto sum = [&](const vector<TString> &samples, TString name){
+        TH1 *h = nullptr;
+        for (const auto &sname : samples){
+          if (!h) h = (TH1*)hists.at(var_info.var).at(sname)->Clone(name);
+          else    h->Add(hists.at(var_info.var).at(sname));
+        }
+        return h;
+      };
+      TString base = filterString(var_info.var) + "_scan_" + dir + "_" + category.name + "_" + postfix_;
+      auto hsig = getIntegratedHist(sum(sig_sample, base + "_sig"), useGreaterThan, !useGreaterThan, useGreaterThan);
+      auto hbkg = getIntegratedHist(sum(mc_samples, base + "_bkg"), useGreaterThan, !useGreaterThan, useGreaterThan);
+
+      TString xtitle = var_info.label + (useGreaterThan ? " > " : " < ") + "X" + (var_info.unit=="" ? "" : " ["+var_info.unit+"]");
+      auto hsigma  = (TH1*)hsig->Clone(base + "_SoverSqrtB"); hsigma->Reset(); hsigma->SetTitle(";" + xtitle + ";Significance");
+      auto hasimov = (TH1*)hsig->Clone(base + "_AsimovZ");    hasimov->Reset(); hasimov->SetTitle(";" + xtitle + ";Significance");
+      auto hsb     = (TH1*)hsig->Clone(base + "_SoverB");     hsb->Reset();     hsb->SetTitle(";" + xtitle + ";S/B");
+
+      auto &points = results[var_info.var];
+      cout << endl << "Cut scan: " << var_info.var << (useGreaterThan ? " > X" : " < X") << " (" << category.name << ")" << endl;
+      cout << setw(12) << "X" << "\t" << setw(20) << "S" << "\t" << setw(20) << "B" << "\t" << setw(10) << "S/sqrt(B)" << "\t" << setw(10) << "Z_A" << "\t" << setw(10) << "S/B" << endl;
+      int ibest = -1;
+      for (int ibin=1; ibin<=hsig->GetNbinsX(); ++ibin){
+        CutScanPoint p;
+        p.cut = useGreaterThan ? hsig->GetXaxis()->GetBinLowEdge(ibin) : hsig->GetXaxis()->GetBinUpEdge(ibin);
+        p.sig = getHistBin(hsig, ibin);
+        p.bkg = getHistBin(hbkg, ibin);
+        p.sOverSqrtB = p.bkg.value>0 ? p.sig.value/std::sqrt(p.bkg.value) : 0;
+        p.asimovZ    = asimovZ(p.sig.value, p.bkg.value);
+        p.sOverB     = p.bkg.value>0 ? p.sig.value/p.bkg.value : 0;
+        points.push_back(p);
+        if (ibest<0 || p.asimovZ > points.at(ibest).asimovZ) ibest = points.size()-1;
+
+        hsigma->SetBinContent(ibin, p.sOverSqrtB);
+        hasimov->SetBinContent(ibin, p.asimovZ);
+        hsb->SetBinContent(ibin, p.sOverB);
+        cout << fixed << setprecision(2) << setw(12) << p.cut << "\t" << setw(20) << p.sig << "\t" << setw(20) << p.bkg << "\t"
+             << setprecision(4) << setw(10) << p.sOverSqrtB << "\t" << setw(10) << p.asimovZ << "\t" << setw(10) << p.sOverB << endl;
+      }
+      if (ibest>=0)
+        cout << "Best Z_A: " << var_info.var << (useGreaterThan ? " > " : " < ") << points.at(ibest).cut << " -> " << points.at(ibest).asimovZ << endl;
+
+      auto leg = initLegend();
+      hsigma->SetLineColor(kBlue);   hsigma->SetMarkerColor(kBlue);
+      hasimov->SetLineColor(kRed);   hasimov->SetMarkerColor(kRed);
+      hsb->SetLineColor(kBlack);     hsb->SetMarkerColor(kBlack);
+      addLegendEntry(leg, hsigma, "S/#sqrt{B}", "L");
+      addLegendEntry(leg, hasimov, "Asimov Z", "L");
+      setLegend(leg, 1, 0.6, 0.75, 0.92, 0.87);
+      if (saveHists_) { saveHist(hsigma); saveHist(hasimov); saveHist(hsb); }
+
+      auto c = drawCompAndRatio({hsigma, hasimov}, {hsb}, leg, "S/B", 0, 1.2*hsb->GetMaximum(), false);
+      if (plotextra) (*plotextra)(c);
+      TString plotname = filterString(var_info.var) + "_CutScan_" + dir + "_" + category.name + "__" + postfix_;
+      c->SetTitle(plotname);
+      savePlot(c, plotname);
+    }
+    return results;
+  }
+
   TH1* plotDataMC(const BinInfo& var_info, const vector<TString> mc_samples, TString data_sample, const Category& category, bool norm_to_data = false, TString norm_cut = "", bool plotlog = false, std::function<void(TCanvas*)> *plotextra = nullptr, bool ttbarRatio = false, vector<TH1*> inUnc_up={}, vector<TH1*> inUnc_dn = {}, bool mcRatio = false){
     // make DataMC plots with the given cateogory selection
     // possible to normalize MC to Data with a different selection (set by *norm_cut*)
@@ -853,12 +1545,21 @@ public:
 
     auto cut = config.sel + " && " + category.cut + TString(selection_=="" ? "" : " && "+selection_);
 
+    // the normalization yields (norm_cut) are booked in the same event loop as the plotted histograms
+    bool bookNorm = norm_to_data && norm_cut!="" && data_sample!="";
+
     TH1 *hdata = nullptr;
+    Quantity data_inc;
     const Sample* d_sample = nullptr;
     if (data_sample!=""){
       d_sample = &config.samples.at(data_sample);
       auto hname = filterString(plotvar) + "_" + data_sample + "_" + category.name + "_" + postfix_;
-      hdata = getHist(d_sample->tree, plotvar, d_sample->wgtvar, cut + d_sample->sel, hname, title, var_info.plotbins);
+      HistBooker booker(d_sample->tree, d_sample->wgtvar);
+      booker.setTreeWeights(d_sample->fileWeights);
+      hdata = booker.book(plotvar, cut + d_sample->sel, hname, title, var_info.plotbins);
+      auto hnorm = bookNorm ? booker.bookYield(norm_cut + d_sample->sel, hname+"_norm") : nullptr;
+      booker.fill();
+      if (hnorm) { data_inc = HistBooker::getYield(hnorm); delete hnorm; }
       prepHists({hdata});
       if (saveHists_) saveHist(hdata);
       addLegendEntry(leg, hdata, d_sample->label, "EP");
@@ -872,20 +1573,40 @@ public:
       if(!std::count(mc.begin(), mc.end(), sMC)) mc.push_back(sMC);
     }
 
+    auto combName = [](TString sname){
+      TString sMC = sname;
+      sMC = sMC.ReplaceAll("-2016","").ReplaceAll("-2017","").ReplaceAll("-2018","");
+      sMC = sMC.ReplaceAll("ttbarplusw-ttbar","ttbarplusw").ReplaceAll("ttbarplusw-tW","ttbarplusw").ReplaceAll("ttbarplusw-ttW","ttbarplusw").ReplaceAll("ttbarplusw-ttZ","ttbarplusw");
+      sMC = sMC.ReplaceAll("-cr","").ReplaceAll("-withveto","");
+      return sMC;
+    };
+
+    // one pass per MC sample: plotted histogram + (optional) normalization yield
+    map<TString, TH1*> mc_buffs;
+    vector<Quantity> mc_quantities;
+    for (auto &sname : mc_samples){
+      bool isPlotted = std::count(mc.begin(), mc.end(), combName(sname));
+      if (!isPlotted && !bookNorm) continue;
+      const auto& sample = config.samples.at(sname);
+      auto hname = filterString(plotvar) + "_" + sname + "_" + category.name + "_" + postfix_;
+      HistBooker booker(sample.tree, sample.wgtvar);
+      booker.setTreeWeights(sample.fileWeights);
+      auto hmc_buff = isPlotted ? booker.book(plotvar, cut + sample.sel, hname, title, var_info.plotbins) : nullptr;
+      auto hnorm = bookNorm ? booker.bookYield(norm_cut + sample.sel, hname+"_norm") : nullptr;
+      booker.fill();
+      if (hmc_buff) mc_buffs[sname] = hmc_buff;
+      if (hnorm) { mc_quantities.push_back(HistBooker::getYield(hnorm)); delete hnorm; }
+    }
+
     bool isOnlyTTBAR = true;;
     for (auto &scomb : mc){
       TH1 *hist = nullptr;
       TString label = "";
       for (auto &sname : mc_samples){
         const auto& sample = config.samples.at(sname);
-	TString sMC = TString(sname);
-        sMC = sMC.ReplaceAll("-2016","").ReplaceAll("-2017","").ReplaceAll("-2018","");
-        sMC = sMC.ReplaceAll("ttbarplusw-ttbar","ttbarplusw").ReplaceAll("ttbarplusw-tW","ttbarplusw").ReplaceAll("ttbarplusw-ttW","ttbarplusw").ReplaceAll("ttbarplusw-ttZ","ttbarplusw");
-	sMC = sMC.ReplaceAll("-cr","").ReplaceAll("-withveto","");
-	if(sMC == scomb){
+	if(combName(sname) == scomb){
           label = sample.label;
-          auto hname = filterString(plotvar) + "_" + sname + "_" + category.name + "_" + postfix_;
-          auto hmc_buff = getHist(sample.tree, plotvar, sample.wgtvar, cut + sample.sel, hname, title, var_info.plotbins);
+          auto hmc_buff = mc_buffs.at(sname);
           for (int ibin=0; ibin<=hmc_buff->GetNbinsX(); ++ibin){
             auto q_nom = getHistBin(hmc_buff, ibin);
             //cout << hmc_buff->GetName() << ": bin: " << ibin << " ---> " << q_nom.value << "+/-" << q_nom.error << endl;
@@ -957,13 +1678,8 @@ public:
           sf = hdata->Integral(1, hsum->GetNbinsX()+1) / hsum->Integral(1, hsum->GetNbinsX()+1);
         }else {
           cout << " ... using normMap " << norm_cut << endl;
-          auto data_inc = getYields(d_sample->tree, d_sample->wgtvar, norm_cut + d_sample->sel);
-          vector<Quantity> mc_quantities;
-          for (auto &sname : mc_samples){
-            const auto& sample = config.samples.at(sname);
-            mc_quantities.push_back(getYields(sample.tree, sample.wgtvar, norm_cut + sample.sel));
-          }
           auto mc_inc = Quantity::sum(mc_quantities);
+          cout << " ... data: " << data_inc << ", mc: " << mc_inc << endl;
           sf = (data_inc/mc_inc).value;
           cout << "... normScaleFactor = " << sf << endl;
         }
@@ -1086,6 +1802,101 @@ public:
     }
   }
 
+  struct Sensitivity{
+    vector<double> zBin;   // per-bin Asimov discovery significance
+    double zComb = 0;      // all bins combined (bins treated as independent counting experiments)
+    double muUp = -1;      // approximate expected CLs upper limit on the signal strength (Asimov, asymptotic)
+  };
+
+  map<TString, Sensitivity> calcSensitivity(const vector<TString>& sig_samples, TString bkg_name = "Total BKG", double bkgRelUnc = 0, double cl = 0.95){
+    // expected sensitivity of each signal in *yields* (after calcYields and sumYields(..., bkg_name))
+    // *bkgRelUnc*: flat relative background uncertainty, uncorrelated between bins
+    // the expected limit solves q_mu,A(mu) = (Phi^-1(1-(1-cl)/2))^2, i.e. mu_up = 1.96 sigma_mu for 95% CLs
+    const auto &bkg = yields.at(bkg_name);
+    const double minBkg = 1e-3; // bins without background would give an infinite significance
+    const double qTarget = std::pow(TMath::NormQuantile(1 - 0.5*(1-cl)), 2);
+
+    const int nMax = std::max(std::thread::hardware_concurrency()*0.8, std::thread::hardware_concurrency()-2.);
+    std::atomic<int> nRunning(0);
+    map<TString, Sensitivity> results;
+    std::mutex results_mutex;
+
+    auto calcOne = [&] (TString sname) {
+      ++nRunning;
+      const auto &sig = yields.at(sname);
+      Sensitivity sens;
+      double z2 = 0;
+      for (unsigned ibin=0; ibin<bkg.size(); ++ibin){
+        double b = std::max(bkg.at(ibin).value, minBkg);
+        double z = asimovZ(sig.at(ibin).value, b, bkgRelUnc*b);
+        sens.zBin.push_back(z);
+        z2 += z*z;
+      }
+      sens.zComb = std::sqrt(z2);
+
+      auto qmu = [&](double mu){
+        double q = 0;
+        for (unsigned ibin=0; ibin<bkg.size(); ++ibin){
+          double b = std::max(bkg.at(ibin).value, minBkg);
+          q += std::pow(asimovZExcl(mu*sig.at(ibin).value, b, bkgRelUnc*b), 2);
+        }
+        return q;
+      };
+      double lo = 0, hi = 1;
+      for (int i=0; i<60 && qmu(hi)<qTarget; ++i) { lo = hi; hi *= 2; }
+      if (qmu(hi) >= qTarget){
+        for (int i=0; i<100 && (hi-lo) > 1e-4*hi; ++i){
+          double mid = 0.5*(lo+hi);
+          if (qmu(mid) < qTarget) lo = mid;
+          else hi = mid;
+        }
+        sens.muUp = hi;
+      }
+
+      std::lock_guard<std::mutex> guard(results_mutex);
+      results[sname] = sens;
+      --nRunning;
+    };
+
+#ifdef ESTTOOLS_MULTITHREAD
+    std::vector<std::thread> pool;
+    for (auto &sname : sig_samples){
+      while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::milliseconds(10)); }
+      pool.emplace_back(calcOne, sname);
+    }
+    for (auto && t : pool) t.join();
+#else
+    for (auto &sname : sig_samples){
+      calcOne(sname);
+    }
+#endif
+
+    // per-bin table and the combined numbers
+    cout << "Expected sensitivity (bkg: " << bkg_name << ", flat bkg unc.: " << toString(bkgRelUnc*100, 0) << "%)" << endl;
+    cout << setw(30) << "bin" << "\t" << setw(20) << bkg_name;
+    for (const auto &sname : sig_samples) cout << "\t" << setw(20) << sname << "\t" << setw(8) << "Z_A";
+    cout << endl;
+    unsigned ibin = 0;
+    for (const auto &cat_name : config.categories){
+      const auto &cat = config.catMaps.at(cat_name);
+      for (const auto &bin : cat.bin.plotnames){
+        cout << setw(30) << (cat.name + "_" + bin) << "\t" << fixed << setprecision(2) << setw(20) << bkg.at(ibin);
+        for (const auto &sname : sig_samples)
+          cout << "\t" << setw(20) << yields.at(sname).at(ibin) << "\t" << setprecision(3) << setw(8) << results.at(sname).zBin.at(ibin) << setprecision(2);
+        cout << endl;
+        ++ibin;
+      }
+    }
+    for (const auto &sname : sig_samples){
+      const auto &sens = results.at(sname);
+      cout << sname << ": combined Z_A = " << setprecision(3) << sens.zComb
+           << ", expected " << toString(cl*100, 0) << "% CLs limit mu < " << (sens.muUp<0 ? "n/a" : toString(sens.muUp, 3)) << endl;
+    }
+    cout << endl;
+
+    return results;
+  }
+
   void printSummary(const vector<vector<Quantity>> &bkgs, const vector<Quantity> &data){
     auto totalbkg = bkgs.front();
     for (unsigned ibkg=1; ibkg<bkgs.size(); ++ibkg) totalbkg = totalbkg + bkgs.at(ibkg);
@@ -1136,19 +1947,102 @@ public:
     fout.close();
   }
 
-  void testSROrthogonality(TString samp = "ttbar"){
-    // test if SRs are orthogonal
-    for (unsigned ia=0; ia<config.categories.size(); ++ia){
-      for (unsigned ib=ia+1; ib<config.categories.size(); ++ib){
-        auto sra = config.categories.at(ia);
-        auto srb = config.categories.at(ib);
-        cout << "------\nTesting " << sra << " && " << srb << endl;
-        auto cut = addCuts({config.catMaps.at(sra).cut, config.catMaps.at(srb).cut});
-        cout << "---\n" << cut << "\n---\n";
-        if (config.samples.at(samp).tree->GetEntries(cut)){
-          throw std::logic_error("Found overlap: " + sra + ", " + srb);
-        }
+  std::string configHash() const {
+    // changes if anything the yields depend on changes: baseline, categories and bins (SR and CR), samples and
+    // their input files (YieldCache::fileIdentity); empty if an input file cannot be stat'ed
+    uint64_t h = hashString(config.sel);
+    auto hashCats = [&h](const vector<TString> &names, const map<TString, Category> &catMaps){
+      for (const auto &cat_name : names){
+        auto it = catMaps.find(cat_name);
+        if (it == catMaps.end()) continue;
+        const auto &cat = it->second;
+        h = hashString(cat.name, h);
+        h = hashString(cat.cut, h);
+        h = hashString(cat.bin.var, h);
+        for (auto edge : cat.bin.plotbins) h = hashNumber(edge, h);
+        for (const auto &bcut : cat.bin.cuts) h = hashString(bcut, h);
+        for (const auto &bname : cat.bin.binnames) h = hashString(bname, h);
+      }
+    };
+    hashCats(config.categories, config.catMaps);
+    hashCats(config.categories, config.crCatMaps);
+    for (const auto &m : config.crMapping){
+      h = hashString(m.first, h);
+      h = hashString(m.second, h);
+    }
+    for (const auto &s : config.samples){
+      const auto &sample = s.second;
+      h = hashString(sample.name, h);
+      for (unsigned i=0; i<sample.nFiles(); ++i){
+        auto id = YieldCache::fileIdentity(sample.filePath(i));
+        if (id=="") return "";
+        h = hashString(id, h);
+        h = hashNumber(sample.fileWeight(i), h);
+      }
+      if (sample.columndir!=""){
+        auto id = YieldCache::fileIdentity(sample.columndir + "/schema.json");
+        if (id=="") return "";
+        h = hashString(id, h);
       }
+      h = hashString(sample.wgtvar, h);
+      h = hashString(sample.sel, h);
+    }
+    return hashToString(h);
+  }
+
+  void saveYieldSnapshot(TString filename = "") const {
+    // write yields, std_yields, binMap and binlist to a binary snapshot (YieldSnapshot) tagged with configHash()
+    if (filename=="") filename = config.outputdir + "/yields.snapshot";
+    YieldSnapshot snap;
+    snap.hash = configHash();
+    snap.yields = yields;
+    snap.std_yields = std_yields;
+    snap.binMap = binMap;
+    snap.binlist = binlist;
+    gSystem->mkdir(gSystem->DirName(filename), true);
+    snap.save(filename.Data());
+    cerr << "### Saved yields of " << yields.size() << " samples to " << filename << " (config " << snap.hash << ")" << endl;
+  }
+
+  bool loadYieldSnapshot(TString filename = "", bool requireSameConfig = true){
+    // restore the state written by saveYieldSnapshot instead of recomputing it
+    // returns false (and leaves the estimator untouched) if there is no snapshot, or if it was made with
+    // a different configuration and *requireSameConfig* is set
+    if (filename=="") filename = config.outputdir + "/yields.snapshot";
+    if (gSystem->AccessPathName(filename)) return false;
+    auto snap = YieldSnapshot::load(filename.Data());
+    auto hash = configHash();
+    if (hash=="" || snap.hash != hash){
+      cerr << "!!! Yield snapshot " << filename << " was made with config " << snap.hash << ", current is " << hash
+           << (requireSameConfig ? ", not using it" : ", using it anyway") << endl;
+      if (requireSameConfig) return false;
+    }
+    yields = std::move(snap.yields);
+    std_yields = std::move(snap.std_yields);
+    binMap = std::move(snap.binMap);
+    binlist = std::move(snap.binlist);
+    cerr << "### Loaded yields of " << yields.size() << " samples from " << filename << endl;
+    return true;
+  }
+
+  void testSROrthogonality(TString samp = "ttbar", bool useCRs = false){
+    // test if SRs (or CRs) are orthogonal: all category cuts are evaluated per event in one pass over the sample,
+    // the full overlap matrix is printed and all overlapping pairs are reported before throwing
+    const auto &sample = config.samples.at(samp);
+    const auto &catMaps = useCRs ? config.crCatMaps : config.catMaps;
+    vector<Category> cats;
+    for (const auto &cat_name : config.categories) cats.push_back(catMaps.at(cat_name));
+
+    CategoryMasker masker(sample.tree, cats, sample.wgtvar);
+    masker.setTreeWeights(sample.fileWeights);
+    masker.fill();
+    masker.printOverlaps();
+
+    auto pairs = masker.overlaps();
+    if (!pairs.empty()){
+      TString msg = "Found " + TString::Format("%zu", pairs.size()) + " overlaps:";
+      for (const auto &p : pairs) msg += " (" + cats.at(p.first).name + ", " + cats.at(p.second).name + ")";
+      throw std::logic_error(msg.Data());
     }
   }
 
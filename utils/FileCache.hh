@@ -0,0 +1,245 @@
+#ifndef ESTTOOLS_FILECACHE_HH_
+#define ESTTOOLS_FILECACHE_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <utime.h>
+#include "TSystem.h"
+#include "TString.h"
+#include "TFile.h"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class FileCache{
+  // Read-through local cache for remote (xrootd, http...) input files.
+  //  * remote files are copied once to *cachedir*, later opens use the local copy
+  //  * a copy is only refreshed if the remote size or modification time changed, checked once per file and
+  //    process (or never if *checkRemote* is false, e.g. when running offline)
+  //  * total size is kept below *maxBytes* by evicting the least recently used copies
+  //  * prefetch() downloads in the background, a later localPath() of the same file waits for it
+  //  * pinned copies (pin/unpin, e.g. the members of an open TChain) are never evicted
+  // Disabled by default: local paths and remote paths are used as they are until enable() is called.
+
+public:
+  static FileCache& instance(){
+    static FileCache cache;
+    return cache;
+  }
+
+  void enable(TString cachedir, Long64_t maxBytes, bool checkRemote = true){
+    std::lock_guard<std::mutex> guard(mutex_);
+    cachedir_ = cachedir;
+    maxBytes_ = maxBytes;
+    checkRemote_ = checkRemote;
+    gSystem->mkdir(cachedir_, true);
+    enabled_ = true;
+    cerr << "### Caching remote inputs in " << cachedir_ << " (max " << maxBytes_/(1024.*1024*1024) << " GB)" << endl;
+  }
+
+  bool enabled() const { return enabled_; }
+
+  static bool isRemote(const TString &path){
+    return path.Contains("://") && !path.BeginsWith("file://");
+  }
+
+  TString localPath(const TString &path){
+    // path to open for *path*: the (up to date) local copy for a remote file, *path* itself otherwise
+    if (!enabled_ || !isRemote(path)) return path;
+    std::shared_future<TString> fut;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = inflight_.find(path);
+      if (it == inflight_.end()){
+        fut = std::async(std::launch::deferred, &FileCache::fetch, this, path).share();
+        inflight_[path] = fut;
+      }else{
+        fut = it->second;
+      }
+    }
+    TString local = fut.get();
+    std::lock_guard<std::mutex> guard(mutex_);
+    inflight_.erase(path);
+    return local;
+  }
+
+  void prefetch(const TString &path){
+    // start copying *path* in the background (no-op if not cached or already in flight)
+    if (!enabled_ || !isRemote(path)) return;
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (inflight_.count(path)) return;
+    inflight_[path] = std::async(std::launch::async, &FileCache::fetch, this, path).share();
+  }
+
+  void pin(const TString &path){
+    // keep the copy of *path* (once fetched) from being evicted until the matching unpin()
+    if (!enabled_ || !isRemote(path)) return;
+    std::lock_guard<std::mutex> guard(mutex_);
+    ++pinned_[cacheName(path)];
+  }
+
+  void unpin(const TString &path){
+    if (!enabled_ || !isRemote(path)) return;
+    std::lock_guard<std::mutex> guard(mutex_);
+    auto it = pinned_.find(cacheName(path));
+    if (it != pinned_.end() && --it->second <= 0) pinned_.erase(it);
+  }
+
+  std::vector<TString> fetchAll(const std::vector<TString> &paths, unsigned nParallel = 4){
+    // pin and fetch *paths* with at most *nParallel* copies at a time; returns the paths to open
+    std::vector<TString> locals(paths.size());
+    for (const auto &p : paths) pin(p);
+    std::atomic<size_t> next(0);
+    auto worker = [&](){
+      for (size_t i = next++; i < paths.size(); i = next++) locals[i] = localPath(paths[i]);
+    };
+    std::vector<std::thread> pool;
+    for (unsigned k=0; k<std::min<size_t>(nParallel, paths.size()); ++k) pool.emplace_back(worker);
+    for (auto && t : pool) t.join();
+    return locals;
+  }
+
+  TFile* open(const TString &path, Option_t *option = ""){
+    // TFile::Open through the cache, falls back to the remote file if the copy cannot be made
+    TString local = localPath(path);
+    return TFile::Open(local, option);
+  }
+
+protected:
+  FileCache() {}
+
+  TString cacheName(const TString &path) const {
+    uint64_t h = 14695981039346656037ULL;
+    for (int i=0; i<path.Length(); ++i){ h ^= (unsigned char)path[i]; h *= 1099511628211ULL; }
+    return cachedir_ + "/" + TString::Format("%016llx", (unsigned long long)h) + "_" + gSystem->BaseName(path);
+  }
+
+  static TString stamp(const FileStat_t &st){
+    return TString::Format("%lld %ld", (long long)st.fSize, st.fMtime);
+  }
+
+  TString fetch(TString path){
+    TString local = cacheName(path);
+    TString stampfile = local + ".stamp";
+
+    bool haveLocal = !gSystem->AccessPathName(local);
+    TString oldstamp;
+    if (haveLocal){
+      std::ifstream in(stampfile.Data());
+      std::string line;
+      std::getline(in, line);
+      oldstamp = line.c_str();
+    }
+
+    bool check = checkRemote_;
+    if (check){
+      std::lock_guard<std::mutex> guard(mutex_);
+      check = !checked_.count(path);
+    }
+    FileStat_t remoteStat;
+    bool remoteOk = true;
+    if (!haveLocal || check) remoteOk = gSystem->GetPathInfo(path, remoteStat) == 0;
+    if (haveLocal && (!check || !remoteOk || stamp(remoteStat) == oldstamp)){
+      touch(local);
+      if (remoteOk) markChecked(path);
+      return local;
+    }
+    if (!remoteOk){
+      cerr << "!!! FileCache: cannot stat " << path << ", reading it remotely" << endl;
+      return path;
+    }
+
+    makeRoom(remoteStat.fSize);
+    auto start = chrono::steady_clock::now();
+    TString tmp = local + TString::Format(".part%d", gSystem->GetPid());
+    if (!TFile::Cp(path, tmp, false)){
+      gSystem->Unlink(tmp);
+      cerr << "!!! FileCache: copy of " << path << " failed, reading it remotely" << endl;
+      return path;
+    }
+    gSystem->Rename(tmp, local);
+    std::ofstream out(stampfile.Data());
+    out << stamp(remoteStat) << endl;
+    markChecked(path);
+    cerr << "### FileCache: copied " << path << " (" << remoteStat.fSize/(1024.*1024) << " MB) in "
+         << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+    return local;
+  }
+
+  void markChecked(const TString &path){
+    // the local copy of *path* is current for the rest of the process
+    std::lock_guard<std::mutex> guard(mutex_);
+    checked_.insert(path);
+  }
+
+  static void touch(const TString &local){
+    // the modification time of a copy is its last use (for LRU eviction)
+    utime(local.Data(), nullptr);
+  }
+
+  void makeRoom(Long64_t incoming){
+    // evict the least recently used copies until *incoming* bytes fit below the limit
+    std::lock_guard<std::mutex> evict_guard(evict_mutex_);
+    struct Entry { TString path; Long64_t size; Long_t mtime; };
+    std::vector<Entry> entries;
+    Long64_t total = 0;
+    void *dir = gSystem->OpenDirectory(cachedir_);
+    if (!dir) return;
+    while (const char *fn = gSystem->GetDirEntry(dir)){
+      TString name(fn);
+      if (name=="." || name==".." || name.EndsWith(".stamp") || name.Contains(".part")) continue;
+      FileStat_t st;
+      TString full = cachedir_ + "/" + name;
+      if (gSystem->GetPathInfo(full, st)) continue;
+      entries.push_back({full, st.fSize, st.fMtime});
+      total += st.fSize;
+    }
+    gSystem->FreeDirectory(dir);
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b){ return a.mtime < b.mtime; });
+    for (const auto &e : entries){
+      if (total + incoming <= maxBytes_) break;
+      {
+        // never evict a copy that is pinned, being fetched or waited for
+        std::lock_guard<std::mutex> guard(mutex_);
+        bool busy = pinned_.count(e.path);
+        for (const auto &f : inflight_) if (cacheName(f.first) == e.path) busy = true;
+        if (busy) continue;
+      }
+      cerr << "### FileCache: evicting " << e.path << endl;
+      gSystem->Unlink(e.path);
+      gSystem->Unlink(e.path + ".stamp");
+      total -= e.size;
+    }
+  }
+
+  std::mutex mutex_;        // protects inflight_ and the settings
+  std::mutex evict_mutex_;  // one eviction at a time
+  std::map<TString, std::shared_future<TString>> inflight_;
+  std::map<TString, int> pinned_; // cache name -> number of pins
+  std::set<TString> checked_;     // remote paths compared with their copy in this process
+
+  bool     enabled_ = false;
+  TString  cachedir_;
+  Long64_t maxBytes_ = 0;
+  bool     checkRemote_ = true;
+
+};
+
+}
+#endif /*ESTTOOLS_FILECACHE_HH_*/
@@ -0,0 +1,262 @@
+#ifndef ESTTOOLS_HISTBOOKER_HH_
+#define ESTTOOLS_HISTBOOKER_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <cassert>
+#include <stdexcept>
+#include <memory>
+#include <vector>
+#include <map>
+#include "TTree.h"
+#include "TH1.h"
+#include "TH2.h"
+#include "THnSparse.h"
+#include "TTreeFormula.h"
+
+#include "MiniTools.hh"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class HistBooker{
+  // Book any number of histograms/yields on one tree, then fill all of them in a single event loop.
+  // Each booking is equivalent to intree->Project(hname, plotvar, wgtvar*(presel && sel), "e"),
+  // but the tree is only read once for all of them.
+  //  * cuts and the weight are evaluated once per event (first instance)
+  //  * the plotted variable is filled for every instance, as TTree::Draw does
+  //  * identical expressions share one TTreeFormula and are evaluated at most once per event
+
+public:
+  HistBooker(TTree *intree, TString wgtvar, TString presel = "") :
+    tree_(intree), wgtvar_(wgtvar), presel_(presel) {
+    assert(intree);
+  }
+
+  virtual ~HistBooker() {}
+
+  TH1D* book(TString plotvar, TString sel, TString hname, TString title, const std::vector<double>& xbins){
+    TH1D* hist = new TH1D(hname, title, xbins.size()-1, xbins.data());
+    hist->Sumw2();
+    addBooking(hist, {plotvar}, sel);
+    return hist;
+  }
+
+  TH1D* book(TString plotvar, TString sel, TString hname, TString title, int nbinsx, double xmin, double xmax){
+    TH1D* hist = new TH1D(hname, title, nbinsx, xmin, xmax);
+    hist->Sumw2();
+    addBooking(hist, {plotvar}, sel);
+    return hist;
+  }
+
+  TH2D* book2D(TString plotvarx, TString plotvary, TString sel, TString hname, TString title, const std::vector<double>& xbins, const std::vector<double>& ybins){
+    // equivalent to Project(hname, plotvary+":"+plotvarx, ...), i.e. x and y are filled from the same instance
+    TH2D* hist = new TH2D(hname, title, xbins.size()-1, xbins.data(), ybins.size()-1, ybins.data());
+    hist->Sumw2();
+    addBooking(hist, {plotvarx, plotvary}, sel);
+    return hist;
+  }
+
+  TH2D* book2D(const BinInfo& xvar, const BinInfo& yvar, TString sel, TString hname){
+    TString title = ";" + xvar.label + (xvar.unit=="" ? "" : " ["+xvar.unit+"]")
+                  + ";" + yvar.label + (yvar.unit=="" ? "" : " ["+yvar.unit+"]") + ";Events";
+    return book2D(xvar.var, yvar.var, sel, hname, title, xvar.plotbins, yvar.plotbins);
+  }
+
+  TH1D* bookYield(TString sel, TString hname){
+    // single-bin histogram counting the weighted events passing *sel*, read it back with getYield()
+    TH1D* hist = new TH1D(hname, hname, 1, 0, 1);
+    hist->Sumw2();
+    addBooking(hist, {}, sel);
+    return hist;
+  }
+
+  THnSparseD* bookSparse(const std::vector<BinInfo>& axes, TString sel, TString hname, TString title = ""){
+    // sparse N-dim histogram with one axis per BinInfo (var + plotbins), e.g. a Lund plane
+    // {ln kT, ln Delta, channel}; all axes are filled from the same instance of the variables
+    std::vector<Int_t> nbins;
+    std::vector<Double_t> xmin, xmax;
+    std::vector<TString> vars;
+    for (const auto &ax : axes){
+      nbins.push_back(ax.nbins);
+      xmin.push_back(ax.plotbins.front());
+      xmax.push_back(ax.plotbins.back());
+      vars.push_back(ax.var);
+    }
+    auto *hn = new THnSparseD(hname, title, axes.size(), nbins.data(), xmin.data(), xmax.data());
+    for (unsigned i=0; i<axes.size(); ++i){
+      hn->GetAxis(i)->Set(axes.at(i).nbins, axes.at(i).plotbins.data());
+      hn->GetAxis(i)->SetName(axes.at(i).var);
+      hn->GetAxis(i)->SetTitle(axes.at(i).label + (axes.at(i).unit=="" ? "" : " ["+axes.at(i).unit+"]"));
+    }
+    hn->Sumw2();
+    addBooking(nullptr, vars, sel, hn);
+    return hn;
+  }
+
+  static Quantity getYield(const TH1 *h){
+    double err = 0.0;
+    double val = h->IntegralAndError(0, h->GetNbinsX()+1, err);
+    return Quantity(val, err);
+  }
+
+  Long64_t fill(Long64_t firstEntry = 0, Long64_t nEntries = -1){
+    // run the event loop (over *nEntries* entries from *firstEntry*, default: all),
+    // returns the number of entries passing *presel* with non-zero weight
+    auto start = chrono::steady_clock::now();
+
+    int iwgt = getFormula(wgtvar_);
+    int ipre = presel_=="" ? -1 : getFormula(presel_);
+
+    Long64_t nselected = 0;
+    int treenumber = -1;
+    Long64_t nentries = tree_->GetEntries();
+    if (nEntries >= 0) nentries = std::min(nentries, firstEntry + nEntries);
+    for (Long64_t i=firstEntry; i<nentries; ++i){
+      if (tree_->LoadTree(i) < 0)
+        throw std::runtime_error(TString::Format("HistBooker: cannot load entry %lld of %s (file missing or unreadable)", i, tree_->GetTitle()).Data());
+      if (tree_->GetTreeNumber() != treenumber){
+        // TChain moved on to the next file
+        treenumber = tree_->GetTreeNumber();
+        for (auto &f : formulas_) f->UpdateFormulaLeaves();
+      }
+      std::fill(evaluated_.begin(), evaluated_.end(), false);
+
+      if (ipre>=0 && eval(ipre)==0) continue;
+      double wgt = eval(iwgt) * entryWeight(treenumber);
+      if (wgt==0) continue;
+      ++nselected;
+
+      processEntry(i, wgt);
+    }
+
+#ifdef DEBUG_
+    auto end = chrono::steady_clock::now();
+    cout << tree_->GetTitle() << ": filled " << bookings_.size() << " bookings in one pass over " << nentries << " entries ("
+         << nselected << " selected), " << chrono::duration<double, milli>(end - start).count() << " ms" << endl;
+#endif
+    return nselected;
+  }
+
+  const TString& wgtvar() const { return wgtvar_; }
+  const TString& presel() const { return presel_; }
+
+  void setTreeWeights(const std::vector<double> &weights){
+    // extra weight of the entries of each tree of a TChain (Sample::fileWeights), empty: 1 for all
+    treeWeights_ = weights;
+  }
+
+protected:
+  struct Booking{
+    TH1 *hist;             // histogram to fill
+    THnBase *hn;           // or: N-dim histogram to fill
+    std::vector<int> ivars; // formula indices of the plotted variables (empty for a yield, x/y for a TH2)
+    int isel;              // formula index of the selection (-1: no extra selection)
+  };
+
+  void addBooking(TH1 *hist, const std::vector<TString>& vars, TString sel, THnBase *hn = nullptr){
+    Booking b;
+    b.hist = hist;
+    b.hn = hn;
+    for (const auto &v : vars) b.ivars.push_back(getFormula(v));
+    b.isel = sel.IsWhitespace() ? -1 : getFormula(sel);
+    bookings_.push_back(b);
+  }
+
+  int countInstances(const Booking &b) const {
+    // scalar variables are broadcast, array variables are walked in parallel up to the shortest one
+    int ninst = -1;
+    for (auto iv : b.ivars){
+      int ndata = formulas_.at(iv)->GetNdata();
+      if (ndata==0) return 0;
+      if (ndata>1) ninst = ninst<0 ? ndata : std::min(ninst, ndata);
+    }
+    return ninst<0 ? 1 : ninst;
+  }
+
+  double evalInstance(int ivar, int k) const {
+    auto &f = formulas_.at(ivar);
+    return f->EvalInstance(f->GetNdata()>1 ? k : 0);
+  }
+
+  virtual void processEntry(Long64_t /*entry*/, double wgt){
+    // called for every entry passing *presel* with non-zero weight
+    for (auto &b : bookings_){
+      double s = b.isel<0 ? 1 : eval(b.isel);
+      if (s==0) continue;
+      fillBooking(b, wgt*s);
+    }
+  }
+
+  virtual void fillBooking(const Booking &b, double wgt){
+    if (b.hn){
+      int ninst = countInstances(b);
+      std::vector<Double_t> x(b.ivars.size());
+      for (int k=0; k<ninst; ++k){
+        for (unsigned i=0; i<b.ivars.size(); ++i) x[i] = evalInstance(b.ivars[i], k);
+        b.hn->Fill(x.data(), wgt);
+      }
+      return;
+    }
+    if (b.ivars.size()==2){
+      auto *h2 = static_cast<TH2*>(b.hist);
+      int ninst = countInstances(b);
+      for (int k=0; k<ninst; ++k) h2->Fill(evalInstance(b.ivars[0], k), evalInstance(b.ivars[1], k), wgt);
+      return;
+    }
+    if (b.ivars.empty()){
+      b.hist->Fill(0.5, wgt);
+      return;
+    }
+    auto &fvar = formulas_.at(b.ivars.front());
+    int ndata = fvar->GetNdata();
+    for (int k=0; k<ndata; ++k){
+      b.hist->Fill(fvar->EvalInstance(k), wgt);
+    }
+  }
+
+  virtual double entryWeight(int treenumber) const { return treeWeights_.empty() ? 1 : treeWeights_.at(treenumber); }
+
+  int getFormula(const TString &expr){
+    auto it = formulaIndex_.find(expr);
+    if (it != formulaIndex_.end()) return it->second;
+
+    auto *f = new TTreeFormula(TString::Format("hbf_%zu", formulas_.size()), expr, tree_);
+    if (f->GetNdim()==0){
+      delete f;
+      throw std::invalid_argument(("HistBooker: cannot compile expression \"" + expr + "\" on tree " + tree_->GetTitle()).Data());
+    }
+    formulas_.emplace_back(f);
+    values_.push_back(0);
+    evaluated_.push_back(false);
+    formulaIndex_[expr] = formulas_.size()-1;
+    return formulas_.size()-1;
+  }
+
+  double eval(int idx){
+    if (!evaluated_[idx]){
+      auto &f = formulas_[idx];
+      values_[idx] = f->GetNdata()>0 ? f->EvalInstance(0) : 0;
+      evaluated_[idx] = true;
+    }
+    return values_[idx];
+  }
+
+  TTree   *tree_;
+  TString wgtvar_;
+  TString presel_;
+  std::vector<double> treeWeights_;
+
+  std::vector<Booking> bookings_;
+  std::vector<std::unique_ptr<TTreeFormula>> formulas_;
+  std::map<TString, int> formulaIndex_;
+  std::vector<double> values_;
+  std::vector<bool>   evaluated_;
+
+};
+
+}
+#endif /*ESTTOOLS_HISTBOOKER_HH_*/
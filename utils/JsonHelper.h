@@ -13,6 +13,11 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <stdexcept>
+#include <zlib.h>
 #include "TString.h"
 
 #include "Quantity.h"
@@ -23,6 +28,326 @@ using json = nlohmann::json;
 
 namespace EstTools{
 
+class JsonStreamWriter{
+  // Writes JSON token by token to a buffered file, without building a DOM first.
+  // Files ending with ".gz" are gzip-compressed. Containers up to *indentDepth* levels deep get one element
+  // per line, deeper ones (e.g. the [value, error] pairs) stay on one line. With *indentDepth* < 0 every
+  // top-level value is written on one line, ended by endRecord() (JSON-lines).
+  // Without a file name the output stays in memory (str(), clear()), e.g. to serialize single records.
+public:
+  JsonStreamWriter(const std::string &filename, int indentDepth = 2) : filename_(filename), indentDepth_(indentDepth) {
+    if (filename.size()>3 && filename.compare(filename.size()-3, 3, ".gz")==0){
+      gz_ = gzopen(filename.c_str(), "wb6");
+    }else{
+      fp_ = std::fopen(filename.c_str(), "w");
+    }
+    if (!gz_ && !fp_) throw std::invalid_argument("JsonStreamWriter: cannot write " + filename);
+    buf_.reserve(BUFSIZE + 256);
+  }
+
+  JsonStreamWriter(int indentDepth = -1) : indentDepth_(indentDepth) {}
+
+  ~JsonStreamWriter() {
+    try{
+      close();
+    }catch (const std::exception &e){
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+  JsonStreamWriter& beginObject() { element(); buf_ += '{'; first_.push_back(true); return *this; }
+  JsonStreamWriter& endObject()   { end('}'); return *this; }
+  JsonStreamWriter& beginArray()  { element(); buf_ += '['; first_.push_back(true); return *this; }
+  JsonStreamWriter& endArray()    { end(']'); return *this; }
+
+  JsonStreamWriter& key(const std::string &k){
+    element();
+    writeString(k);
+    buf_ += ": ";
+    afterKey_ = true;
+    return *this;
+  }
+
+  JsonStreamWriter& value(double v){
+    element();
+    if (std::isfinite(v)){
+      // shortest of %.15g and %.17g that reads back as *v*
+      char tmp[32];
+      int n = std::snprintf(tmp, sizeof(tmp), "%.15g", v);
+      if (std::strtod(tmp, nullptr) != v) n = std::snprintf(tmp, sizeof(tmp), "%.17g", v);
+      buf_.append(tmp, n);
+    }else{
+      buf_ += "null"; // like nlohmann::json
+    }
+    flushIfFull();
+    return *this;
+  }
+
+  JsonStreamWriter& value(const std::string &v){
+    element();
+    writeString(v);
+    flushIfFull();
+    return *this;
+  }
+
+  JsonStreamWriter& endRecord(){
+    buf_ += '\n';
+    flushIfFull();
+    return *this;
+  }
+
+  JsonStreamWriter& rawRecord(const std::string &record){
+    // a record serialized elsewhere (including its newline)
+    buf_ += record;
+    flushIfFull();
+    return *this;
+  }
+
+  const std::string& str() const { return buf_; }
+  void clear() { buf_.clear(); first_.clear(); afterKey_ = false; }
+
+  void close(){
+    if (!gz_ && !fp_) return;
+    if (indentDepth_ >= 0) buf_ += '\n';
+    flush();
+    if (gz_) gzclose(gz_);
+    if (fp_) std::fclose(fp_);
+    gz_ = nullptr;
+    fp_ = nullptr;
+  }
+
+private:
+  void element(){
+    // separator and indentation before a new element (a value directly after its key has none)
+    if (afterKey_){
+      afterKey_ = false;
+      return;
+    }
+    if (first_.empty()) return;
+    if (!first_.back()) buf_ += ',';
+    first_.back() = false;
+    newline(first_.size());
+  }
+
+  void end(char c){
+    bool empty = first_.back();
+    size_t depth = first_.size();
+    first_.pop_back();
+    if (!empty && (int)depth <= indentDepth_) newline(depth-1);
+    buf_ += c;
+    flushIfFull();
+  }
+
+  void newline(size_t depth){
+    if ((int)depth > indentDepth_){
+      if (!buf_.empty() && buf_.back()==',') buf_ += ' ';
+      return;
+    }
+    buf_ += '\n';
+    buf_.append(2*depth, ' ');
+  }
+
+  void writeString(const std::string &str){
+    buf_ += '"';
+    for (char c : str){
+      switch (c){
+      case '"':  buf_ += "\\\""; break;
+      case '\\': buf_ += "\\\\"; break;
+      case '\n': buf_ += "\\n"; break;
+      case '\t': buf_ += "\\t"; break;
+      case '\r': buf_ += "\\r"; break;
+      default:
+        if ((unsigned char)c < 0x20){
+          char tmp[8];
+          std::snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+          buf_ += tmp;
+        }else{
+          buf_ += c;
+        }
+      }
+    }
+    buf_ += '"';
+  }
+
+  void flushIfFull() { if (buf_.size() >= BUFSIZE) flush(); }
+
+  void flush(){
+    if (buf_.empty() || (!gz_ && !fp_)) return;
+    bool ok = gz_ ? gzwrite(gz_, buf_.data(), buf_.size()) == (int)buf_.size()
+                  : std::fwrite(buf_.data(), 1, buf_.size(), fp_) == buf_.size();
+    if (!ok) throw std::runtime_error("JsonStreamWriter: write to " + filename_ + " failed");
+    buf_.clear();
+  }
+
+  static constexpr size_t BUFSIZE = 1 << 16;
+
+  std::string filename_;
+  int indentDepth_;
+  gzFile gz_ = nullptr;
+  FILE *fp_ = nullptr;
+  std::string buf_;
+  std::vector<bool> first_; // per open container: no element written yet
+  bool afterKey_ = false;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct JsonSaxHandler{
+  // callbacks of JsonSaxReader, in document order
+  virtual ~JsonSaxHandler() {}
+  virtual void startObject() {}
+  virtual void endObject() {}
+  virtual void startArray() {}
+  virtual void endArray() {}
+  virtual void key(const std::string &/*k*/) {}
+  virtual void number(double /*v*/) {}
+  virtual void string(const std::string &/*v*/) {}
+  virtual void boolean(bool /*v*/) {}
+  virtual void null() {}
+};
+
+class JsonSaxReader{
+  // Event-based JSON reader: tokens are passed to a JsonSaxHandler as they are read, nothing is kept.
+  // Reads plain and gzip-compressed files alike.
+public:
+  static void parse(const std::string &filename, JsonSaxHandler &handler){
+    JsonSaxReader reader(filename, handler);
+    reader.skipSpace();
+    reader.parseValue();
+    reader.skipSpace();
+    if (reader.peek() != EOF) reader.fail("trailing characters");
+  }
+
+private:
+  JsonSaxReader(const std::string &filename, JsonSaxHandler &handler) : filename_(filename), handler_(handler) {
+    gz_ = gzopen(filename.c_str(), "rb");
+    if (!gz_) throw std::invalid_argument("JsonSaxReader: cannot read " + filename);
+    gzbuffer(gz_, 1 << 16);
+  }
+
+  ~JsonSaxReader() { gzclose(gz_); }
+
+  int peek(){
+    if (pos_ == len_){
+      len_ = gzread(gz_, buf_, sizeof(buf_));
+      pos_ = 0;
+      if (len_ <= 0){ len_ = 0; return EOF; }
+    }
+    return (unsigned char)buf_[pos_];
+  }
+
+  int get(){
+    int c = peek();
+    if (c != EOF) ++pos_;
+    return c;
+  }
+
+  void expect(char c){
+    if (get() != c) fail(std::string("expected '") + c + "'");
+  }
+
+  void skipSpace(){
+    for (int c = peek(); c==' ' || c=='\n' || c=='\t' || c=='\r'; c = peek()) get();
+  }
+
+  void fail(const std::string &what){
+    throw std::invalid_argument("JsonSaxReader: " + what + " in " + filename_);
+  }
+
+  void parseValue(){
+    int c = peek();
+    if (c=='{'){
+      get();
+      handler_.startObject();
+      skipSpace();
+      if (peek()=='}'){ get(); handler_.endObject(); return; }
+      while (true){
+        skipSpace();
+        if (peek()!='"') fail("expected a key");
+        handler_.key(parseString());
+        skipSpace();
+        expect(':');
+        skipSpace();
+        parseValue();
+        skipSpace();
+        c = get();
+        if (c=='}') break;
+        if (c!=',') fail("expected ',' or '}'");
+      }
+      handler_.endObject();
+    }else if (c=='['){
+      get();
+      handler_.startArray();
+      skipSpace();
+      if (peek()==']'){ get(); handler_.endArray(); return; }
+      while (true){
+        skipSpace();
+        parseValue();
+        skipSpace();
+        c = get();
+        if (c==']') break;
+        if (c!=',') fail("expected ',' or ']'");
+      }
+      handler_.endArray();
+    }else if (c=='"'){
+      handler_.string(parseString());
+    }else if (c=='t'){
+      literal("true"); handler_.boolean(true);
+    }else if (c=='f'){
+      literal("false"); handler_.boolean(false);
+    }else if (c=='n'){
+      literal("null"); handler_.null();
+    }else if (c=='-' || (c>='0' && c<='9')){
+      std::string num;
+      for (c = peek(); c=='-' || c=='+' || c=='.' || c=='e' || c=='E' || (c>='0' && c<='9'); c = peek()) num += (char)get();
+      handler_.number(std::strtod(num.c_str(), nullptr));
+    }else{
+      fail("unexpected character");
+    }
+  }
+
+  void literal(const char *word){
+    for (const char *p = word; *p; ++p) expect(*p);
+  }
+
+  std::string parseString(){
+    expect('"');
+    std::string str;
+    while (true){
+      int c = get();
+      if (c==EOF) fail("unterminated string");
+      if (c=='"') break;
+      if (c!='\\'){ str += (char)c; continue; }
+      c = get();
+      switch (c){
+      case 'n': str += '\n'; break;
+      case 't': str += '\t'; break;
+      case 'r': str += '\r'; break;
+      case 'b': str += '\b'; break;
+      case 'f': str += '\f'; break;
+      case 'u': {
+        char hex[5] = {0};
+        for (int i=0; i<4; ++i) hex[i] = (char)get();
+        unsigned cp = std::strtoul(hex, nullptr, 16);
+        // UTF-8 encoding of the code point (surrogate pairs are not combined)
+        if (cp < 0x80) str += (char)cp;
+        else if (cp < 0x800){ str += (char)(0xC0 | (cp>>6)); str += (char)(0x80 | (cp&0x3F)); }
+        else { str += (char)(0xE0 | (cp>>12)); str += (char)(0x80 | ((cp>>6)&0x3F)); str += (char)(0x80 | (cp&0x3F)); }
+        break;
+      }
+      default: str += (char)c; // '"', '\\', '/'
+      }
+    }
+    return str;
+  }
+
+  std::string filename_;
+  JsonSaxHandler &handler_;
+  gzFile gz_ = nullptr;
+  char buf_[1 << 16];
+  int pos_ = 0, len_ = 0;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 class JsonHelper{
 public:
   static json convertToJson(const std::map<TString, std::vector<Quantity>> &input, bool withError = true){
@@ -34,8 +359,82 @@ public:
   }
 
   static void dumpJson(std::string filename, const std::map<TString, std::vector<Quantity>> &input, bool withError = true){
-    const auto &j = convertToJson(input, withError);
-    dumpJson(filename, j);
+    // streamed: {sample: [[value, error], ...]} (or [value, ...] without errors), gzip-compressed for *.gz
+    JsonStreamWriter out(filename);
+    out.beginObject();
+    for (const auto &it : input){
+      out.key(it.first.Data()).beginArray();
+      for (const auto &q : it.second){
+        if (withError) out.beginArray().value(q.value).value(q.error).endArray();
+        else out.value(q.value);
+      }
+      out.endArray();
+    }
+    out.endObject();
+    out.close();
+  }
+
+  static void dumpJson(std::string filename, const std::map<std::string, std::map<std::string, std::vector<double>>> &input){
+    // streamed: {process: {bin: [value, error, ...]}} (e.g. BaseEstimator::std_yields)
+    JsonStreamWriter out(filename);
+    out.beginObject();
+    for (const auto &proc : input){
+      out.key(proc.first).beginObject();
+      for (const auto &bin : proc.second){
+        out.key(bin.first).beginArray();
+        for (auto v : bin.second) out.value(v);
+        out.endArray();
+      }
+      out.endObject();
+    }
+    out.endObject();
+    out.close();
+  }
+
+  static std::map<TString, std::vector<Quantity>> loadYields(std::string filename){
+    // read back a file written by dumpJson(filename, yields, withError), with or without errors
+    struct Handler : public JsonSaxHandler {
+      std::map<TString, std::vector<Quantity>> yields;
+      std::vector<Quantity> *current = nullptr;
+      std::vector<double> pair;
+      int depth = 0;
+      void startObject() override { ++depth; }
+      void endObject() override { --depth; }
+      void key(const std::string &k) override { if (depth==1) current = &yields[k.c_str()]; }
+      void startArray() override { if (++depth==3) pair.clear(); }
+      void endArray() override {
+        if (depth--==3 && current) current->emplace_back(pair.size()>0 ? pair[0] : 0, pair.size()>1 ? pair[1] : 0);
+      }
+      void number(double v) override {
+        if (depth==2 && current) current->emplace_back(v);
+        else if (depth==3) pair.push_back(v);
+      }
+      void null() override { number(std::nan("")); }
+    } handler;
+    JsonSaxReader::parse(filename, handler);
+    return handler.yields;
+  }
+
+  static std::map<std::string, std::map<std::string, std::vector<double>>> loadStdYields(std::string filename){
+    // read back a file written by dumpJson(filename, std_yields)
+    struct Handler : public JsonSaxHandler {
+      std::map<std::string, std::map<std::string, std::vector<double>>> yields;
+      std::string proc;
+      std::vector<double> *current = nullptr;
+      int depth = 0;
+      void startObject() override { ++depth; }
+      void endObject() override { --depth; }
+      void key(const std::string &k) override {
+        if (depth==1){ proc = k; yields[proc]; }
+        else if (depth==2) current = &yields[proc][k];
+      }
+      void startArray() override { ++depth; }
+      void endArray() override { --depth; }
+      void number(double v) override { if (depth==3 && current) current->push_back(v); }
+      void null() override { number(std::nan("")); }
+    } handler;
+    JsonSaxReader::parse(filename, handler);
+    return handler.yields;
   }
 
   static void dumpJson(std::string filename, const json &j){
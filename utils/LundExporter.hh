@@ -0,0 +1,581 @@
+#ifndef ESTTOOLS_LUNDEXPORTER_HH_
+#define ESTTOOLS_LUNDEXPORTER_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include "TFile.h"
+#include "TTree.h"
+
+#include "HistBooker.hh"
+#include "JsonHelper.h"
+#include "NpyWriter.hh"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// LundNet training data straight from the trees: gzipped JSON-lines files per sample, split and shard,
+// <outdir>/{train,test,valid}/<sample>[_<shard>].json.gz, one event per line:
+//   {"sample": "ggHto2tau", "label": 1, "weight": 0.02, "run": 1, "luminosityBlock": 2, "event": 3,
+//    "<scalar>": x, ..., "<object>": [[f1, f2, ...], ...]}
+// where every object is its declustering sequence (array features walked in parallel, one row per step).
+// Or, with kLundNpy, the same content as fixed-layout .npy arrays, <outdir>/{train,test,valid}/<sample>[_<shard>]_<array>.npy:
+//   <object>: float32 (N, maxSteps, nFeatures), zero-padded   <object>_len: int32 (N,) steps before padding
+//   scalars:  float32 (N, nScalars)   weight: float32 (N,)   label: int32 (N,)   ids: uint64 (N, 3) run, lumi, event
+// with the feature order in <outdir>/lund_schema.json (exportLundMixture writes the same arrays, see writeLundNpy).
+
+enum LundFormat { kLundJson, kLundNpy };
+
+struct LundFeatures{
+  map<TString, vector<TString>> objects; // object name -> features per declustering step
+  map<TString, TString> scalars;         // name -> event-level feature
+  unsigned maxSteps = 16;                // steps kept per object in the .npy arrays (longer sequences are truncated)
+};
+
+struct LundSplit{
+  // train/test/valid assignment from the hash of (run, lumi, event): an event always lands in the same split,
+  // whatever the file order or the number of workers (same hash as event_uniform() in mergeLundJSON.py)
+  // events beyond fTrain+fTest+fValid are not written
+  double fTrain = 0.6;
+  double fTest  = 0.2;
+  double fValid = 0.2;
+  TString runvar   = "run";
+  TString lumivar  = "luminosityBlock";
+  TString eventvar = "event";
+
+  static const vector<TString>& names(){
+    static const vector<TString> n = {"train", "test", "valid"};
+    return n;
+  }
+
+  static double uniform(uint64_t run, uint64_t lumi, uint64_t event, uint64_t seed = HASH_SEED){
+    // FNV-1a of the three ids, then the splitmix64 finalizer to spread consecutive event numbers; in [0, 1)
+    uint64_t z = hashNumber(event, hashNumber(lumi, hashNumber(run, seed)));
+    z ^= z >> 30; z *= 0xbf58476d1ce4e5b9ULL;
+    z ^= z >> 27; z *= 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0/9007199254740992.0);
+  }
+
+  int split(uint64_t run, uint64_t lumi, uint64_t event) const {
+    double u = uniform(run, lumi, event);
+    if (u < fTrain) return 0;
+    if (u < fTrain+fTest) return 1;
+    if (u < fTrain+fTest+fValid) return 2;
+    return -1;
+  }
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class LundRecordBuilder : public HistBooker {
+  // one pass over a sample tree, builds the record of every selected event; derived classes decide
+  // what happens with it in processRecord()
+
+public:
+  LundRecordBuilder(TTree *intree, const LundFeatures &features, TString wgtvar, TString presel,
+                    TString sname, int label, const LundSplit &split) :
+    HistBooker(intree, wgtvar, presel), sname_(sname.Data()), label_(label), split_(split) {
+    irun_ = getFormula(split.runvar);
+    ilumi_ = getFormula(split.lumivar);
+    ievent_ = getFormula(split.eventvar);
+    for (const auto &obj : features.objects){
+      vector<int> ifeat;
+      for (const auto &expr : obj.second) ifeat.push_back(getFormula(expr));
+      objects_.emplace_back(obj.first.Data(), ifeat);
+    }
+    for (const auto &sc : features.scalars) scalars_.emplace_back(sc.first.Data(), getFormula(sc.second));
+  }
+
+  virtual ~LundRecordBuilder() {}
+
+protected:
+  virtual void processEntry(Long64_t /*entry*/, double wgt) override {
+    uint64_t run = eval(irun_), lumi = eval(ilumi_), event = eval(ievent_);
+    processRecord(run, lumi, event, wgt);
+  }
+
+  virtual void processRecord(uint64_t run, uint64_t lumi, uint64_t event, double wgt) = 0;
+
+  void writeRecord(JsonStreamWriter &out, uint64_t run, uint64_t lumi, uint64_t event, double wgt){
+    out.beginObject();
+    out.key("sample").value(sname_);
+    out.key("label").value(label_);
+    out.key("weight").value(wgt);
+    out.key("run").value(run);
+    out.key("luminosityBlock").value(lumi);
+    out.key("event").value(event);
+    for (const auto &sc : scalars_) out.key(sc.first).value(eval(sc.second));
+    for (const auto &obj : objects_){
+      out.key(obj.first).beginArray();
+      int nsteps = countSteps(obj.second);
+      for (int k=0; k<nsteps; ++k){
+        out.beginArray();
+        for (auto iv : obj.second) out.value(evalInstance(iv, k));
+        out.endArray();
+      }
+      out.endArray();
+    }
+    out.endObject().endRecord();
+  }
+
+  int countSteps(const vector<int> &ifeat) const {
+    int nsteps = -1;
+    for (auto iv : ifeat){
+      int ndata = formulas_.at(iv)->GetNdata();
+      nsteps = nsteps<0 ? ndata : std::min(nsteps, ndata);
+    }
+    return std::max(nsteps, 0);
+  }
+
+  static TString outputName(const TString &outdir, const TString &split, const TString &sname, int shard){
+    return outdir + "/" + split + "/" + sname + (shard<0 ? TString("") : TString::Format("_%d", shard));
+  }
+
+  std::string sname_;
+  int label_;
+  LundSplit split_;
+  vector<pair<std::string, vector<int>>> objects_;
+  vector<pair<std::string, int>> scalars_;
+  int irun_, ilumi_, ievent_;
+
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class LundRecordWriter : public LundRecordBuilder {
+  // every record in the file of its split
+
+public:
+  LundRecordWriter(TTree *intree, const LundFeatures &features, TString wgtvar, TString presel,
+                   TString sname, int label, TString outdir, const LundSplit &split, int shard = -1) :
+    LundRecordBuilder(intree, features, wgtvar, presel, sname, label, split) {
+    for (const auto &name : LundSplit::names()){
+      gSystem->mkdir(outdir + "/" + name, true);
+      writers_.emplace_back(new JsonStreamWriter((outputName(outdir, name, sname, shard) + ".json.gz").Data(), -1));
+    }
+  }
+
+  virtual ~LundRecordWriter() {}
+
+  Long64_t write(Long64_t firstEntry = 0, Long64_t nEntries = -1){
+    fill(firstEntry, nEntries);
+    for (auto &w : writers_) w->close();
+    return nwritten_;
+  }
+
+protected:
+  virtual void processRecord(uint64_t run, uint64_t lumi, uint64_t event, double wgt) override {
+    int isplit = split_.split(run, lumi, event);
+    if (isplit < 0) return;
+    writeRecord(*writers_.at(isplit), run, lumi, event, wgt);
+    ++nwritten_;
+  }
+
+  vector<std::unique_ptr<JsonStreamWriter>> writers_;
+  Long64_t nwritten_ = 0;
+
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class LundNpyWriter : public LundRecordBuilder {
+  // every record as one row of the .npy arrays of its split, streamed in chunks
+
+public:
+  LundNpyWriter(TTree *intree, const LundFeatures &features, TString wgtvar, TString presel,
+                TString sname, int label, TString outdir, const LundSplit &split, int shard = -1) :
+    LundRecordBuilder(intree, features, wgtvar, presel, sname, label, split), maxSteps_(features.maxSteps) {
+    for (const auto &name : LundSplit::names()){
+      gSystem->mkdir(outdir + "/" + name, true);
+      std::string base = outputName(outdir, name, sname, shard).Data();
+      Arrays a;
+      for (const auto &obj : objects_){
+        a.objects.emplace_back(new NpyWriter<float>(base + "_" + obj.first + ".npy", {maxSteps_, obj.second.size()}));
+        a.lengths.emplace_back(new NpyWriter<int32_t>(base + "_" + obj.first + "_len.npy"));
+      }
+      a.scalars.reset(new NpyWriter<float>(base + "_scalars.npy", {scalars_.size()}));
+      a.weight.reset(new NpyWriter<float>(base + "_weight.npy"));
+      a.label.reset(new NpyWriter<int32_t>(base + "_label.npy"));
+      a.ids.reset(new NpyWriter<uint64_t>(base + "_ids.npy", {3}));
+      arrays_.push_back(std::move(a));
+    }
+  }
+
+  virtual ~LundNpyWriter() {}
+
+  Long64_t write(Long64_t firstEntry = 0, Long64_t nEntries = -1){
+    fill(firstEntry, nEntries);
+    for (auto &a : arrays_){
+      for (auto &w : a.objects) w->close();
+      for (auto &w : a.lengths) w->close();
+      a.scalars->close();
+      a.weight->close();
+      a.label->close();
+      a.ids->close();
+    }
+    return nwritten_;
+  }
+
+protected:
+  virtual void processRecord(uint64_t run, uint64_t lumi, uint64_t event, double wgt) override {
+    int isplit = split_.split(run, lumi, event);
+    if (isplit < 0) return;
+    auto &a = arrays_.at(isplit);
+    for (unsigned io=0; io<objects_.size(); ++io){
+      const auto &ifeat = objects_[io].second;
+      int32_t nsteps = std::min<int>(countSteps(ifeat), maxSteps_);
+      row_.assign(maxSteps_ * ifeat.size(), 0);
+      for (int k=0; k<nsteps; ++k)
+        for (unsigned f=0; f<ifeat.size(); ++f) row_[k*ifeat.size() + f] = evalInstance(ifeat[f], k);
+      a.objects[io]->append(row_);
+      a.lengths[io]->append(&nsteps);
+    }
+    row_.clear();
+    for (const auto &sc : scalars_) row_.push_back(eval(sc.second));
+    a.scalars->append(row_);
+    float w = wgt;
+    a.weight->append(&w);
+    int32_t label = label_;
+    a.label->append(&label);
+    uint64_t ids[3] = {run, lumi, event};
+    a.ids->append(ids);
+    ++nwritten_;
+  }
+
+  struct Arrays{
+    vector<std::unique_ptr<NpyWriter<float>>>   objects;
+    vector<std::unique_ptr<NpyWriter<int32_t>>> lengths;
+    std::unique_ptr<NpyWriter<float>>    scalars;
+    std::unique_ptr<NpyWriter<float>>    weight;
+    std::unique_ptr<NpyWriter<int32_t>>  label;
+    std::unique_ptr<NpyWriter<uint64_t>> ids;
+  };
+
+  size_t maxSteps_;
+  vector<Arrays> arrays_; // per split
+  vector<float> row_;
+  Long64_t nwritten_ = 0;
+
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class WeightedReservoir{
+  // weighted sampling without replacement of exactly *size* items in one streaming pass (A-ES, Efraimidis-Spirakis):
+  // item i gets the key u_i^(1/w_i) (kept as ln(u_i)/w_i), the *size* largest keys are the sample.
+  // Reservoirs filled from disjoint inputs merge into the reservoir of the union, so workers can run in parallel;
+  // with u_i from a hash of the item (not a random generator) the result is reproducible.
+
+public:
+  typedef pair<double, std::string> Item; // (key, record)
+
+  WeightedReservoir(size_t size) : size_(size) {}
+
+  static double key(double u, double w) { return std::log(u) / w; }
+
+  void offer(double key, const std::string &record){
+    if (size_==0) return;
+    if (heap_.size() < size_){
+      heap_.emplace_back(key, record);
+      std::push_heap(heap_.begin(), heap_.end(), std::greater<Item>());
+    }else if (key > heap_.front().first){
+      std::pop_heap(heap_.begin(), heap_.end(), std::greater<Item>());
+      heap_.back() = Item(key, record);
+      std::push_heap(heap_.begin(), heap_.end(), std::greater<Item>());
+    }
+  }
+
+  double threshold() const {
+    // keys at or below it are not taken
+    if (size_==0) return std::numeric_limits<double>::infinity();
+    return heap_.size() < size_ ? -std::numeric_limits<double>::infinity() : heap_.front().first;
+  }
+
+  bool wants(double key) const { return key > threshold(); }
+
+  void merge(const WeightedReservoir &other){
+    for (const auto &item : other.heap_) offer(item.first, item.second);
+  }
+
+  vector<Item> items() const {
+    // largest key first
+    vector<Item> sorted(heap_);
+    std::sort(sorted.begin(), sorted.end(), std::greater<Item>());
+    return sorted;
+  }
+
+  size_t size() const { return heap_.size(); }
+
+  void clear() { heap_.clear(); }
+
+private:
+  size_t size_;
+  vector<Item> heap_; // min-heap on the key
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class SharedReservoir{
+  // the WeightedReservoir of parallel workers: they merge small buffers into it, and its threshold is published
+  // so that they skip the records that can no longer get in
+
+public:
+  SharedReservoir(size_t size) : reservoir_(size), threshold_(reservoir_.threshold()) {}
+
+  bool wants(double key) const { return key > threshold_.load(std::memory_order_relaxed); }
+
+  void merge(WeightedReservoir &buffer){
+    // empties *buffer*
+    std::lock_guard<std::mutex> guard(mutex_);
+    reservoir_.merge(buffer);
+    threshold_ = reservoir_.threshold();
+    buffer.clear();
+  }
+
+  const WeightedReservoir& reservoir() const { return reservoir_; }
+
+private:
+  WeightedReservoir reservoir_;
+  std::atomic<double> threshold_;
+  std::mutex mutex_;
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class LundMixSampler : public LundRecordBuilder {
+  // offers every record to a SharedReservoir, weighted by |event weight| (the weight expressions of the
+  // samples are normalized to the cross section per event); the record is only built if it can get in,
+  // and at most *bufferSize* records are held before they are merged
+
+public:
+  LundMixSampler(TTree *intree, const LundFeatures &features, TString wgtvar, TString presel,
+                 TString sname, int label, const LundSplit &split, SharedReservoir &mixture, size_t bufferSize = 4096) :
+    LundRecordBuilder(intree, features, wgtvar, presel, sname, label, split),
+    mixture_(mixture), buffer_(std::max<size_t>(bufferSize, 1)), bufferSize_(std::max<size_t>(bufferSize, 1)),
+    seed_(hashString(sname, MIX_SEED)) {}
+
+  virtual ~LundMixSampler() {}
+
+  void sample(Long64_t firstEntry = 0, Long64_t nEntries = -1){
+    fill(firstEntry, nEntries);
+    mixture_.merge(buffer_);
+  }
+
+  // same as mergeLundJSON.py, independent of the split; the sample name is hashed in as well,
+  // since MC samples reuse (run, lumi, event)
+  static const uint64_t MIX_SEED = HASH_SEED ^ 0x6d6978;
+
+protected:
+  virtual void processRecord(uint64_t run, uint64_t lumi, uint64_t event, double wgt) override {
+    double w = std::abs(wgt);
+    if (w <= 0) return;
+    double key = WeightedReservoir::key(LundSplit::uniform(run, lumi, event, seed_), w);
+    if (!mixture_.wants(key)) return;
+    record_.clear();
+    writeRecord(record_, run, lumi, event, wgt);
+    buffer_.offer(key, record_.str()); // never full here, nothing is dropped
+    if (buffer_.size() >= bufferSize_) mixture_.merge(buffer_);
+  }
+
+  SharedReservoir &mixture_;
+  WeightedReservoir buffer_;
+  size_t bufferSize_;
+  uint64_t seed_;
+  JsonStreamWriter record_; // in memory
+
+};
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void writeLundNpy(const vector<std::string> &records, const LundFeatures &features, const std::string &base){
+  // JSON-lines records (LundRecordBuilder::writeRecord) as the .npy arrays of LundNpyWriter, <base>_<array>.npy
+  auto number = [](const json &v){ return v.is_number() ? v.get<double>() : std::numeric_limits<double>::quiet_NaN(); };
+  const size_t maxSteps = features.maxSteps;
+  vector<std::unique_ptr<NpyWriter<float>>>   objects;
+  vector<std::unique_ptr<NpyWriter<int32_t>>> lengths;
+  for (const auto &obj : features.objects){
+    objects.emplace_back(new NpyWriter<float>(base + "_" + obj.first.Data() + ".npy", {maxSteps, obj.second.size()}));
+    lengths.emplace_back(new NpyWriter<int32_t>(base + "_" + obj.first.Data() + "_len.npy"));
+  }
+  NpyWriter<float>    scalars(base + "_scalars.npy", {features.scalars.size()});
+  NpyWriter<float>    weight(base + "_weight.npy");
+  NpyWriter<int32_t>  label(base + "_label.npy");
+  NpyWriter<uint64_t> ids(base + "_ids.npy", {3});
+  vector<float> row;
+  for (const auto &record : records){
+    const auto j = json::parse(record);
+    unsigned io = 0;
+    for (const auto &obj : features.objects){
+      const auto &steps = j.at(obj.first.Data());
+      const size_t nfeat = obj.second.size();
+      int32_t nsteps = std::min(steps.size(), maxSteps);
+      row.assign(maxSteps * nfeat, 0);
+      for (int k=0; k<nsteps; ++k)
+        for (unsigned f=0; f<nfeat; ++f) row[k*nfeat + f] = number(steps.at(k).at(f));
+      objects[io]->append(row);
+      lengths[io]->append(&nsteps);
+      ++io;
+    }
+    row.clear();
+    for (const auto &sc : features.scalars) row.push_back(number(j.at(sc.first.Data())));
+    scalars.append(row);
+    float w = number(j.at("weight"));
+    weight.append(&w);
+    int32_t l = j.at("label").get<int>();
+    label.append(&l);
+    // the ids are written as doubles, exact below 2^53
+    uint64_t id[3] = {(uint64_t)j.at("run").get<double>(), (uint64_t)j.at("luminosityBlock").get<double>(), (uint64_t)j.at("event").get<double>()};
+    ids.append(id);
+  }
+  for (auto &w : objects) w->close();
+  for (auto &w : lengths) w->close();
+  scalars.close();
+  weight.close();
+  label.close();
+  ids.close();
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void exportLundMixture(const BaseConfig &config, const vector<TString> &sample_names, const LundFeatures &features, TString outfile, size_t size, int label = 0,
+                       const LundSplit &split = LundSplit(), int nShards = 1, LundFormat format = kLundJson){
+  // cross-section-weighted mixture of exactly *size* events (fewer if the inputs have fewer) of *sample_names*,
+  // drawn in one pass over all inputs: every (sample, file, shard) runs in parallel and merges its candidates into the
+  // shared reservoir in small batches, so memory stays at about *size* records whatever the number of workers
+  // written to *outfile* as JSON lines, or with kLundNpy as the arrays <outfile>_<array>.npy (a .json.gz suffix is dropped)
+  ROOT::EnableThreadSafety();
+  const int nMax = std::max(std::thread::hardware_concurrency()*0.8, std::thread::hardware_concurrency()-2.);
+  std::atomic<int> nRunning(0);
+  std::mutex mutex;
+  TString errors;
+  SharedReservoir mixture(size);
+
+  auto sampleOne = [&](TString sname, unsigned ifile, int shard){
+    ++nRunning;
+    try{
+      const auto &sample = config.samples.at(sname);
+      TDirectory::TContext ctxt;
+      std::unique_ptr<TFile> infile(FileCache::instance().open(sample.filePath(ifile)));
+      if (!infile || infile->IsZombie())
+        throw std::invalid_argument(("exportLundMixture: cannot open " + sample.filePath(ifile)).Data());
+      TTree *intree = nullptr;
+      infile->GetObject(sample.treename, intree);
+      if (!intree)
+        throw std::invalid_argument(("exportLundMixture: no tree " + sample.treename + " in " + sample.filePath(ifile)).Data());
+      intree->SetTitle(sname);
+      Long64_t nPerShard = (intree->GetEntries() + nShards - 1) / nShards;
+      // multi-file samples are normalized file by file (Sample::fileWgtvar)
+      LundMixSampler sampler(intree, features, sample.fileWgtvar(ifile), config.sel + sample.sel, sname, label, split, mixture);
+      sampler.sample(shard*nPerShard, nPerShard);
+    }catch (const std::exception &e){
+      std::lock_guard<std::mutex> guard(mutex);
+      errors += TString(e.what()) + "\n";
+    }
+    --nRunning;
+  };
+
+  std::vector<std::thread> pool;
+  for (const auto &sname : sample_names){
+    for (unsigned ifile=0; ifile<config.samples.at(sname).nFiles(); ++ifile){
+      for (int shard=0; shard<nShards; ++shard){
+        while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
+        pool.emplace_back(sampleOne, sname, ifile, shard);
+      }
+    }
+  }
+  for (auto && t : pool) t.join();
+  if (errors != "") throw std::invalid_argument(errors.Data());
+
+  gSystem->mkdir(gSystem->DirName(outfile), true);
+  if (format == kLundNpy){
+    vector<std::string> records;
+    for (const auto &item : mixture.reservoir().items()) records.push_back(item.second);
+    if (outfile.EndsWith(".json.gz")) outfile.Remove(outfile.Length() - 8);
+    writeLundNpy(records, features, outfile.Data());
+  }else{
+    JsonStreamWriter out(outfile.Data(), -1);
+    for (const auto &item : mixture.reservoir().items()) out.rawRecord(item.second);
+    out.close();
+  }
+  cout << "### Wrote a mixture of " << mixture.reservoir().size() << " events of " << sample_names.size() << " samples to " << outfile << endl;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+void exportLundSamples(const BaseConfig &config, const map<TString, int> &labels, const LundFeatures &features,
+                       TString outdir, const LundSplit &split = LundSplit(), int nShards = 1, LundFormat format = kLundJson){
+  // write the LundNet records of the samples in *labels* (sample name -> class label) for the events passing
+  // config.sel and the sample selection; every sample (every file of a multi-file sample) is cut into *nShards* entry
+  // ranges processed in parallel, each writing its own files (<sample>_<shard>.* if there is more than one, numbered
+  // file by file). The split does not depend on nShards.
+  ROOT::EnableThreadSafety();
+  if (format == kLundNpy){
+    json schema;
+    schema["maxSteps"] = features.maxSteps;
+    for (const auto &obj : features.objects)
+      for (const auto &f : obj.second) schema["objects"][obj.first.Data()].push_back(f.Data());
+    for (const auto &sc : features.scalars) schema["scalars"].push_back(sc.first.Data());
+    gSystem->mkdir(outdir, true);
+    std::ofstream fschema((outdir + "/lund_schema.json").Data());
+    fschema << schema.dump(2) << endl;
+  }
+  const int nMax = std::max(std::thread::hardware_concurrency()*0.8, std::thread::hardware_concurrency()-2.);
+  std::atomic<int> nRunning(0);
+  std::mutex error_mutex;
+  TString errors;
+
+  auto exportOne = [&](TString sname, int label, unsigned ifile, int shard){
+    ++nRunning;
+    try{
+      auto start = chrono::steady_clock::now();
+      const auto &sample = config.samples.at(sname);
+      TDirectory::TContext ctxt;
+      std::unique_ptr<TFile> infile(FileCache::instance().open(sample.filePath(ifile)));
+      if (!infile || infile->IsZombie())
+        throw std::invalid_argument(("exportLundSamples: cannot open " + sample.filePath(ifile)).Data());
+      TTree *intree = nullptr;
+      infile->GetObject(sample.treename, intree);
+      if (!intree)
+        throw std::invalid_argument(("exportLundSamples: no tree " + sample.treename + " in " + sample.filePath(ifile)).Data());
+      intree->SetTitle(sname);
+      Long64_t nPerShard = (intree->GetEntries() + nShards - 1) / nShards;
+      Long64_t n = 0;
+      int nOut = sample.nFiles()*nShards, iout = ifile*nShards + shard;
+      if (format == kLundNpy){
+        LundNpyWriter writer(intree, features, sample.fileWgtvar(ifile), config.sel + sample.sel, sname, label, outdir, split,
+                             nOut>1 ? iout : -1);
+        n = writer.write(shard*nPerShard, nPerShard);
+      }else{
+        LundRecordWriter writer(intree, features, sample.fileWgtvar(ifile), config.sel + sample.sel, sname, label, outdir, split,
+                                nOut>1 ? iout : -1);
+        n = writer.write(shard*nPerShard, nPerShard);
+      }
+      cout << "### Exported " << n << " events of " << sname << (nOut>1 ? TString::Format(" (shard %d)", iout) : TString("")) << " in "
+           << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << endl;
+    }catch (const std::exception &e){
+      std::lock_guard<std::mutex> guard(error_mutex);
+      errors += TString(e.what()) + "\n";
+    }
+    --nRunning;
+  };
+
+  std::vector<std::thread> pool;
+  for (const auto &l : labels){
+    for (unsigned ifile=0; ifile<config.samples.at(l.first).nFiles(); ++ifile){
+      for (int shard=0; shard<nShards; ++shard){
+        while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
+        pool.emplace_back(exportOne, l.first, l.second, ifile, shard);
+      }
+    }
+  }
+  for (auto && t : pool) t.join();
+  if (errors != "") throw std::invalid_argument(errors.Data());
+}
+
+}
+#endif /*ESTTOOLS_LUNDEXPORTER_HH_*/
@@ -4,6 +4,8 @@
 #if !defined(__CINT__) || defined(__MAKECINT__)
 #include <iostream>
 #include <sstream>
+#include <iomanip>
+#include <cstdint>
 #include <cassert>
 #include <stdexcept>
 #include <memory>
@@ -37,6 +39,37 @@ TString filterString(TString instr){
   return instr.ReplaceAll(" ", "").ReplaceAll(",", "_").ReplaceAll("/", "_over_").ReplaceAll("*", "_times_").ReplaceAll("(", "_").ReplaceAll(")", "_");
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// 64-bit FNV-1a hash, used to fingerprint plot/yield inputs
+const uint64_t HASH_SEED = 14695981039346656037ULL;
+
+uint64_t hashBytes(const void *data, size_t len, uint64_t h = HASH_SEED){
+  auto *p = static_cast<const unsigned char*>(data);
+  for (size_t i=0; i<len; ++i){
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+uint64_t hashString(const TString &str, uint64_t h = HASH_SEED){
+  // include the length so that ("ab","c") and ("a","bc") differ
+  size_t len = str.Length();
+  h = hashBytes(&len, sizeof(len), h);
+  return hashBytes(str.Data(), len, h);
+}
+
+template<typename Number>
+uint64_t hashNumber(Number value, uint64_t h = HASH_SEED){
+  return hashBytes(&value, sizeof(value), h);
+}
+
+std::string hashToString(uint64_t h){
+  std::stringstream ss;
+  ss << std::hex << std::setw(16) << std::setfill('0') << h;
+  return ss.str();
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 TString joinString(const vector<TString>& vec, TString delimiter){
   TString rlt = "";
@@ -272,6 +305,37 @@ TH1* getIntegratedHist(const TH1* h, bool useGreaterThan = true, bool useUnderfl
 
 }
 
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+double asimovZ(double s, double b, double sigmaB = 0){
+  // median discovery significance for *s* signal on *b* background (Asimov data set),
+  // with an absolute background uncertainty *sigmaB* if > 0 (Cowan et al., arXiv:1007.1727)
+  if (s <= 0 || b <= 0) return 0;
+  double z2;
+  if (sigmaB <= 0){
+    z2 = 2 * ((s+b)*std::log(1 + s/b) - s);
+  }else{
+    double sb2 = sigmaB*sigmaB;
+    z2 = 2 * ((s+b)*std::log((s+b)*(b+sb2)/(b*b+(s+b)*sb2)) - b*b/sb2*std::log(1 + sb2*s/(b*(b+sb2))));
+  }
+  return z2 > 0 ? std::sqrt(z2) : 0;
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+double asimovZExcl(double s, double b, double sigmaB = 0){
+  // median exclusion significance of *s* signal if only *b* background is observed (background-only Asimov data set),
+  // with an absolute background uncertainty *sigmaB* if > 0; Z^2 is the q_mu of the Asimov data set
+  if (s <= 0 || b <= 0) return 0;
+  double z2;
+  if (sigmaB <= 0){
+    z2 = 2 * (s - b*std::log(1 + s/b));
+  }else{
+    double sb2 = sigmaB*sigmaB;
+    double x = std::sqrt((s+b)*(s+b) - 4*s*b*sb2/(b+sb2));
+    z2 = 2 * (s - b*std::log((b+s+x)/(2*b)) - b*b/sb2*std::log((b-s+x)/(2*b))) - (b+s-x)*(1+b/sb2);
+  }
+  return z2 > 0 ? std::sqrt(z2) : 0;
+}
+
 // ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 TH1D* convertToHist(const vector<Quantity> &vec, TString hname, TString title, const BinInfo *bin=nullptr, int start = 0, int manualBins = 0){
   auto nbins = vec.size();
@@ -0,0 +1,107 @@
+#ifndef ESTTOOLS_NPYWRITER_HH_
+#define ESTTOOLS_NPYWRITER_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+template<typename T> struct NpyType;
+template<> struct NpyType<float>    { static const char* descr() { return "<f4"; } };
+template<> struct NpyType<double>   { static const char* descr() { return "<f8"; } };
+template<> struct NpyType<int32_t>  { static const char* descr() { return "<i4"; } };
+template<> struct NpyType<uint64_t> { static const char* descr() { return "<u8"; } };
+
+template<typename T>
+class NpyWriter{
+  // C-order .npy array (format 1.0, little-endian) of shape (rows, *rowShape*), appended row by row and written
+  // in chunks; the number of rows is not known in advance, it is patched into the fixed-size header by close()
+  // (numpy.load(fname, mmap_mode='r') then maps it without parsing)
+
+public:
+  NpyWriter(const std::string &filename, const std::vector<size_t> &rowShape = {}, size_t chunkRows = 4096) :
+    filename_(filename), rowShape_(rowShape), chunkRows_(chunkRows) {
+    rowSize_ = 1;
+    for (auto n : rowShape_) rowSize_ *= n;
+    chunk_.reserve(chunkRows * rowSize_);
+    fp_ = std::fopen(filename.c_str(), "wb");
+    if (!fp_) throw std::invalid_argument("NpyWriter: cannot write " + filename);
+    writeHeader();
+  }
+
+  ~NpyWriter() {
+    try{
+      close();
+    }catch (const std::exception &e){
+      std::cerr << e.what() << std::endl;
+    }
+  }
+
+  void append(const T *row){
+    chunk_.insert(chunk_.end(), row, row + rowSize_);
+    ++rows_;
+    if (chunk_.size() >= chunkRows_ * rowSize_) flush();
+  }
+
+  void append(const std::vector<T> &row) { append(row.data()); }
+
+  size_t rows() const { return rows_; }
+
+  void close(){
+    if (!fp_) return;
+    flush();
+    std::fseek(fp_, 0, SEEK_SET);
+    writeHeader();
+    std::fclose(fp_);
+    fp_ = nullptr;
+  }
+
+private:
+  void writeHeader(){
+    // magic, version 1.0, header length (uint16), then the dict padded with spaces to HEADER_SIZE bytes
+    std::string shape = "(" + std::to_string(rows_) + ",";
+    for (auto n : rowShape_) shape += " " + std::to_string(n) + ",";
+    if (!rowShape_.empty()) shape.pop_back();
+    shape += ")";
+    std::string dict = std::string("{'descr': '") + NpyType<T>::descr() + "', 'fortran_order': False, 'shape': " + shape + ", }";
+    const size_t prefix = 10;
+    if (prefix + dict.size() + 1 > HEADER_SIZE) throw std::invalid_argument("NpyWriter: shape too long for " + filename_);
+    dict.append(HEADER_SIZE - prefix - dict.size() - 1, ' ');
+    dict += '\n';
+    uint16_t hlen = dict.size();
+    char magic[prefix] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0, 0, 0};
+    std::memcpy(magic + 8, &hlen, sizeof(hlen));
+    std::fwrite(magic, 1, prefix, fp_);
+    std::fwrite(dict.data(), 1, dict.size(), fp_);
+  }
+
+  void flush(){
+    if (chunk_.empty()) return;
+    if (std::fwrite(chunk_.data(), sizeof(T), chunk_.size(), fp_) != chunk_.size())
+      throw std::runtime_error("NpyWriter: write to " + filename_ + " failed");
+    chunk_.clear();
+  }
+
+  static const size_t HEADER_SIZE = 128; // multiple of 64, as the format asks for
+
+  std::string filename_;
+  std::vector<size_t> rowShape_;
+  size_t chunkRows_;
+  size_t rowSize_;
+  size_t rows_ = 0;
+  std::vector<T> chunk_;
+  FILE *fp_ = nullptr;
+};
+
+}
+#endif /*ESTTOOLS_NPYWRITER_HH_*/
@@ -0,0 +1,226 @@
+#ifndef ESTTOOLS_SAMPLEREGISTRY_HH_
+#define ESTTOOLS_SAMPLEREGISTRY_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include "TROOT.h"
+#include "TSystem.h"
+#include "TString.h"
+#include "TFile.h"
+#include "TTree.h"
+
+#include "json.hpp"
+#include "Threading.hh"
+#include "MiniTools.hh"
+#include "Config.h"
+#include "YieldCache.hh"
+
+using namespace std;
+using json = nlohmann::json;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class SampleRegistry{
+  // Cross sections per dataset, loaded from a JSON file
+  //   {"GluGluHToTauTauUncorrelatedDecay_Filtered_M125_TuneCP5_13TeV": {"xsec": 5.261}, ...}
+  // and the generator sum of weights of every input file, read once from its "Runs" tree (genEventSumw) and
+  // kept in a JSON cache keyed by the file identity (path + size + mtime, as in the YieldCache).
+  // A file belongs to the dataset whose name its file name contains (longest match, see findDataset), and its
+  // events are normalized by xsec / (sum of genEventSumw over the files of that dataset) at runtime, with
+  // the per-event generator weight (genWeight) in the weight expression.
+
+public:
+  SampleRegistry(TString filename, TString cachefile = "") :
+    filename_(filename), cachefile_(cachefile!="" ? cachefile : TString(filename).ReplaceAll(".json", "") + "_sumw.json") {
+    std::ifstream in(filename_.Data());
+    if (!in.good()) throw std::invalid_argument(("SampleRegistry: cannot read " + filename_).Data());
+    json j;
+    in >> j;
+    for (auto it = j.begin(); it != j.end(); ++it){
+      if (!it.value().count("xsec"))
+        throw std::invalid_argument("SampleRegistry: no xsec for " + it.key() + " in " + filename_.Data());
+      xsecs_[it.key().c_str()] = it.value()["xsec"].get<double>();
+    }
+    loadCache();
+    cerr << "### Loaded " << xsecs_.size() << " datasets from " << filename_ << " (" << cache_.size() << " cached sums of weights)" << endl;
+  }
+
+  bool has(const TString &dataset) const { return xsecs_.count(dataset); }
+
+  double xsec(const TString &dataset) const {
+    auto it = xsecs_.find(dataset);
+    if (it == xsecs_.end()) throw std::invalid_argument(("SampleRegistry: unknown dataset " + dataset + " in " + filename_).Data());
+    return it->second;
+  }
+
+  TString dataset(const TString &path) const {
+    auto it = findDataset(xsecs_, path);
+    if (it == xsecs_.end()) throw std::invalid_argument(("SampleRegistry: no dataset in " + filename_ + " for " + path).Data());
+    return it->first;
+  }
+
+  double sumw(const TString &path){
+    // genEventSumw of *path*, computed on the first request only (every time if the file cannot be stat'ed)
+    auto id = YieldCache::fileIdentity(path);
+    if (id=="") return readSumw(path);
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = cache_.find(id);
+      if (it != cache_.end()) return it->second;
+    }
+    double w = readSumw(path);
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      cache_[id] = w;
+    }
+    saveCache();
+    return w;
+  }
+
+  void computeSumw(const vector<TString> &files){
+    // fill the cache for all *files* (in a thread pool), then write it once
+    vector<TString> todo;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      for (const auto &f : files){
+        auto id = YieldCache::fileIdentity(f);
+        if (id!="" && !cache_.count(id)) todo.push_back(f);
+      }
+    }
+    if (todo.empty()) return;
+
+    ROOT::EnableThreadSafety();
+    auto start = chrono::steady_clock::now();
+    const int nMax = std::max(std::thread::hardware_concurrency()*0.8, std::thread::hardware_concurrency()-2.);
+    std::atomic<int> nRunning(0);
+    TString errors;
+
+    auto readOne = [&](TString path){
+      ++nRunning;
+      try{
+        double w = readSumw(path);
+        std::lock_guard<std::mutex> guard(mutex_);
+        cache_[YieldCache::fileIdentity(path)] = w;
+      }catch (const std::exception &e){
+        std::lock_guard<std::mutex> guard(mutex_);
+        errors += TString(e.what()) + "\n";
+      }
+      --nRunning;
+    };
+
+#ifdef ESTTOOLS_MULTITHREAD
+    std::vector<std::thread> pool;
+    for (const auto &f : todo){
+      while(nRunning>=nMax) { std::this_thread::sleep_for(std::chrono::seconds(1)); }
+      pool.emplace_back(readOne, f);
+    }
+    for (auto && t : pool) t.join();
+#else
+    for (const auto &f : todo) readOne(f);
+#endif
+    saveCache();
+    if (errors != "") throw std::invalid_argument(errors.Data());
+    cerr << "### Read the sum of weights of " << todo.size() << " files in "
+         << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+  }
+
+  map<TString, SampleNorm> norms(const vector<TString> &files){
+    // dataset -> (xsec, sum of genEventSumw over the *files* of the dataset), e.g. for BaseConfig::addSample
+    computeSumw(files);
+    map<TString, SampleNorm> result;
+    for (const auto &f : files){
+      auto ds = dataset(f);
+      auto &norm = result[ds];
+      norm.xsec = xsec(ds);
+      norm.sumw += sumw(f);
+    }
+    return result;
+  }
+
+  TString normalize(const TString &wgtvar, const TString &dataset, const vector<TString> &files){
+    // *wgtvar* scaled by xsec / sumw of *dataset*, for samples whose file(s) hold a single dataset
+    double sum = 0;
+    computeSumw(files);
+    for (const auto &f : files) sum += sumw(f);
+    if (sum == 0) throw std::invalid_argument(("SampleRegistry::normalize: zero sum of weights for " + dataset).Data());
+    return TString::Format("%.17g*(%s)", xsec(dataset) / sum, wgtvar.Data());
+  }
+
+  void addSample(BaseConfig &config, TString name, TString label, TString files, TString wgtvar, TString extraCut){
+    // BaseConfig::addSample of the files in *files* (directories or wildcards in config.inputdir), normalized per dataset
+    config.addSample(name, label, files, wgtvar, extraCut, norms(config.matchFiles(files)));
+  }
+
+  static double readSumw(const TString &path){
+    // the Runs tree is tiny: read it in place, a FileCache copy of the whole file is not worth it
+    TDirectory::TContext ctxt;
+    std::unique_ptr<TFile> infile(TFile::Open(path));
+    if (!infile || infile->IsZombie())
+      throw std::invalid_argument(("SampleRegistry: cannot open " + path).Data());
+    TTree *runs = nullptr;
+    infile->GetObject("Runs", runs);
+    if (!runs) throw std::invalid_argument(("SampleRegistry: no Runs tree in " + path).Data());
+    // NanoAOD before v6 calls it genEventSumw_
+    const char *bname = runs->GetBranch("genEventSumw") ? "genEventSumw" : "genEventSumw_";
+    if (!runs->GetBranch(bname)) throw std::invalid_argument(("SampleRegistry: no genEventSumw in " + path).Data());
+    Double_t w = 0;
+    runs->SetBranchStatus("*", 0);
+    runs->SetBranchStatus(bname, 1);
+    runs->SetBranchAddress(bname, &w);
+    double sum = 0;
+    for (Long64_t i=0; i<runs->GetEntries(); ++i){
+      runs->GetEntry(i);
+      sum += w;
+    }
+    runs->ResetBranchAddresses();
+    return sum;
+  }
+
+protected:
+  void loadCache(){
+    std::ifstream in(cachefile_.Data());
+    if (!in.good()) return;
+    json j;
+    in >> j;
+    std::lock_guard<std::mutex> guard(mutex_);
+    for (auto it = j.begin(); it != j.end(); ++it) cache_[it.key()] = it.value()["sumw"].get<double>();
+  }
+
+  void saveCache(){
+    // merged with what other processes may have written meanwhile, then replaced in one rename
+    loadCache();
+    json j;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      for (const auto &c : cache_) j[c.first] = {{"sumw", c.second}};
+    }
+    gSystem->mkdir(gSystem->DirName(cachefile_), true);
+    TString tmp = cachefile_ + TString::Format(".part%d_%u", gSystem->GetPid(), nsaves_++);
+    std::ofstream out(tmp.Data());
+    out << j.dump(1) << endl;
+    out.close();
+    gSystem->Rename(tmp, cachefile_);
+  }
+
+  TString filename_;
+  TString cachefile_;
+  map<TString, double> xsecs_;
+  std::mutex mutex_;
+  map<std::string, double> cache_;
+  std::atomic<unsigned> nsaves_{0};
+
+};
+
+}
+#endif /*ESTTOOLS_SAMPLEREGISTRY_HH_*/
@@ -0,0 +1,131 @@
+#ifndef ESTTOOLS_SKIMWRITER_HH_
+#define ESTTOOLS_SKIMWRITER_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <memory>
+#include <set>
+#include <chrono>
+#include "TFile.h"
+#include "TTree.h"
+#include "TNamed.h"
+#include "Compression.h"
+
+#include "EstHelper.hh"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// Slim skims: only the branches an analysis reads, only the events passing its baseline.
+// The skim stores a stamp of (input file, selection, branch list), so an up-to-date skim is not rewritten.
+
+const char* SKIM_STAMP_NAME = "SkimStamp";
+
+std::string skimStamp(TString infile, Long64_t nentries, TString sel, const std::set<TString> &branches){
+  uint64_t h = hashString(infile);
+  h = hashNumber(nentries, h);
+  h = hashString(sel, h);
+  for (const auto &b : branches) h = hashString(b, h);
+  return hashToString(h);
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+bool isSkimUpToDate(TString outfile, const std::string &stamp){
+  if (gSystem->AccessPathName(outfile)) return false;
+  TDirectory::TContext ctxt;
+  std::unique_ptr<TFile> f(TFile::Open(outfile));
+  if (!f || f->IsZombie()) return false;
+  auto *named = dynamic_cast<TNamed*>(f->Get(SKIM_STAMP_NAME));
+  return named && stamp == named->GetTitle();
+}
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+Long64_t writeSkim(TString infile, TString treename, TString outfile, const vector<TString> &exprs, TString sel,
+                   const vector<TString> &copyTrees = {"Runs"}){
+  // copy the entries of *treename* passing *sel*, keeping only the branches read by *exprs* and *sel*
+  //  * LZ4 compression and ~30 MB clusters: quick to decompress, few large reads
+  //  * small per-file trees in *copyTrees* (e.g. the NanoAOD "Runs" tree with the generator weight sums) are copied whole
+  // returns the number of entries written (-1 if the skim was already up to date)
+  auto start = chrono::steady_clock::now();
+  TDirectory::TContext ctxt;
+  std::unique_ptr<TFile> fin(FileCache::instance().open(infile));
+  if (!fin || fin->IsZombie())
+    throw std::invalid_argument(("writeSkim: cannot open " + infile).Data());
+  TTree *intree = nullptr;
+  fin->GetObject(treename, intree);
+  if (!intree)
+    throw std::invalid_argument(("writeSkim: no tree " + treename + " in " + infile).Data());
+
+  vector<TString> allExprs(exprs);
+  allExprs.push_back(sel);
+  auto branches = getReferencedBranches(intree, allExprs);
+  auto stamp = skimStamp(infile, intree->GetEntries(), sel, branches);
+  if (isSkimUpToDate(outfile, stamp)){
+    cerr << "### Skim " << outfile << " is up to date" << endl;
+    return -1;
+  }
+
+  intree->SetBranchStatus("*", 0);
+  for (const auto &b : branches) intree->SetBranchStatus(b, 1);
+
+  gSystem->mkdir(gSystem->DirName(outfile), true);
+  TString tmpfile = outfile + ".part";
+  std::unique_ptr<TFile> fout(TFile::Open(tmpfile, "RECREATE", "", ROOT::CompressionSettings(ROOT::kLZ4, 4)));
+  if (!fout || fout->IsZombie())
+    throw std::invalid_argument(("writeSkim: cannot create " + outfile).Data());
+  fout->cd();
+  TTree *outtree = intree->CloneTree(0);
+  outtree->SetAutoFlush(-30000000);
+
+  TTreeFormula fsel("skimsel", sel.IsWhitespace() ? TString("1") : sel, intree);
+  Long64_t nentries = intree->GetEntries();
+  int treenumber = -1;
+  for (Long64_t i=0; i<nentries; ++i){
+    if (intree->LoadTree(i) < 0)
+      throw std::runtime_error(TString::Format("writeSkim: cannot load entry %lld of %s", i, intree->GetTitle()).Data());
+    if (intree->GetTreeNumber() != treenumber){
+      treenumber = intree->GetTreeNumber();
+      fsel.UpdateFormulaLeaves();
+    }
+    if (fsel.GetNdata()==0 || fsel.EvalInstance(0)==0) continue;
+    intree->GetEntry(i);
+    outtree->Fill();
+  }
+  outtree->Write();
+
+  for (const auto &e : allExprs){
+    // every expression has to work on the skim itself, or it would fail (or silently differ) downstream
+    if (e.IsWhitespace()) continue;
+    TTreeFormula fcheck("skimcheck", e, outtree);
+    if (fcheck.GetNdim()==0){
+      fout->Close();
+      gSystem->Unlink(tmpfile);
+      throw std::invalid_argument(("writeSkim: expression \"" + e + "\" does not compile on the skim of " + infile).Data());
+    }
+  }
+
+  for (const auto &tname : copyTrees){
+    TTree *t = nullptr;
+    fin->GetObject(tname, t);
+    if (!t) continue;
+    fout->cd();
+    t->CloneTree(-1, "fast")->Write();
+  }
+  fout->cd();
+  TNamed(SKIM_STAMP_NAME, stamp.c_str()).Write();
+  Long64_t nout = outtree->GetEntries();
+  fout->Close();
+  fout.reset();
+  gSystem->Rename(tmpfile, outfile);
+
+  cerr << "### Skimmed " << infile << " -> " << outfile << ": " << nout << "/" << nentries << " entries, "
+       << branches.size() << "/" << intree->GetListOfBranches()->GetEntries() << " branches ("
+       << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s)" << endl;
+  return nout;
+}
+
+}
+#endif /*ESTTOOLS_SKIMWRITER_HH_*/
@@ -0,0 +1,8 @@
+#ifndef ESTTOOLS_THREADING_HH_
+#define ESTTOOLS_THREADING_HH_
+
+// Run the per-sample, per-file and per-candidate loops of Estimator.hh, SampleRegistry.hh and CutOptimizer.hh
+// in thread pools. Every header that tests the switch includes this one, so it does not depend on include order.
+#define ESTTOOLS_MULTITHREAD
+
+#endif /*ESTTOOLS_THREADING_HH_*/
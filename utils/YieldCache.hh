@@ -0,0 +1,171 @@
+#ifndef ESTTOOLS_YIELDCACHE_HH_
+#define ESTTOOLS_YIELDCACHE_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include "TSystem.h"
+#include "TString.h"
+
+#include "MiniTools.hh"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+class YieldCache{
+  // Memoized yield vectors, content-addressed by (producer, file identity, tree, weight, selection, binning):
+  //  * the producer names the code computing the yields (e.g. the estimator class), estimators overriding
+  //    getYieldVectorWrapper do not share entries
+  //  * the file identity is path + size + modification time, so a rewritten input file gets new keys; files
+  //    that cannot be stat'ed have no identity and their yields are not cached
+  //  * the files of a multi-file sample are cached one by one (BaseEstimator::cachedFileYields), before their
+  //    normalization, so a new cross section does not invalidate them
+  //  * expressions are compared without whitespace, "a>1 && b" and "a > 1&&b" share an entry
+  //  * always kept in memory for the process; with enable(dir) also on disk (one small file per key),
+  //    shared by later macro runs and by all estimators using the same samples
+  // Stale on-disk entries are never read again (their key cannot be produced) and can be deleted at any time.
+
+public:
+  static YieldCache& instance(){
+    static YieldCache cache;
+    return cache;
+  }
+
+  void enable(TString cachedir){
+    std::lock_guard<std::mutex> guard(mutex_);
+    cachedir_ = cachedir;
+    gSystem->mkdir(cachedir_, true);
+    cerr << "### Caching yields in " << cachedir_ << endl;
+  }
+
+  void setActive(bool active = true) { active_ = active; }
+  bool active() const { return active_; }
+
+  void clear(){
+    std::lock_guard<std::mutex> guard(mutex_);
+    memory_.clear();
+  }
+
+  static TString canonical(TString expr){
+    expr.ReplaceAll(" ", "");
+    expr.ReplaceAll("\t", "");
+    expr.ReplaceAll("\n", "");
+    return expr;
+  }
+
+  static std::string fileIdentity(const TString &path){
+    // hash of the path, size and modification time of *path*, empty if it cannot be stat'ed
+    FileStat_t st;
+    if (gSystem->GetPathInfo(path, st) != 0) return "";
+    uint64_t h = hashString(path);
+    h = hashNumber((Long64_t)st.fSize, h);
+    h = hashNumber((Long64_t)st.fMtime, h);
+    return hashToString(h);
+  }
+
+  static std::string inputIdentity(const Sample &sample){
+    // the tree and, if the sample has one, its column store (either may be read, see ColumnStore::matches),
+    // all files and their weights for a multi-file sample; empty if an input file has no identity
+    auto id = fileIdentity(sample.filepath);
+    if (id=="") return "";
+    uint64_t h = hashString(id);
+    if (sample.columndir!=""){
+      auto cid = fileIdentity(sample.columndir + "/schema.json");
+      if (cid=="") return "";
+      h = hashString(cid, h);
+    }
+    for (unsigned i=0; i<sample.files.size(); ++i){
+      auto fid = fileIdentity(sample.files.at(i));
+      if (fid=="") return "";
+      h = hashString(fid, h);
+      h = hashNumber(sample.fileWeight(i), h);
+    }
+    return hashToString(h);
+  }
+
+  static std::string key(const Sample &sample, const std::string &inputId, const TString &sel, const BinInfo &bin,
+                         const std::string &producer){
+    // inputId is inputIdentity(sample), computed once per sample by the caller; empty (do not cache) if it is empty
+    if (inputId=="") return "";
+    uint64_t h = hashString(producer.c_str());
+    h = hashString(inputId, h);
+    h = hashString(sample.treename, h);
+    h = hashString(canonical(sample.wgtvar), h);
+    h = hashString(canonical(sel), h);
+    h = hashString(canonical(bin.var), h);
+    for (auto edge : bin.plotbins) h = hashNumber(edge, h);
+    return hashToString(h);
+  }
+
+  bool get(const std::string &key, vector<Quantity> &yields){
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto it = memory_.find(key);
+      if (it != memory_.end()){
+        yields = it->second;
+        return true;
+      }
+      if (cachedir_=="") return false;
+    }
+    std::ifstream in(diskName(key).Data(), std::ios::binary);
+    if (!in.good()) return false;
+    uint32_t n = 0;
+    in.read(reinterpret_cast<char*>(&n), sizeof(n));
+    vector<Quantity> v(n);
+    for (auto &q : v){
+      in.read(reinterpret_cast<char*>(&q.value), sizeof(q.value));
+      in.read(reinterpret_cast<char*>(&q.error), sizeof(q.error));
+    }
+    if (!in.good()) return false;
+    std::lock_guard<std::mutex> guard(mutex_);
+    memory_[key] = v;
+    yields = v;
+    return true;
+  }
+
+  void put(const std::string &key, const vector<Quantity> &yields){
+    TString dir;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      memory_[key] = yields;
+      dir = cachedir_;
+    }
+    if (dir=="") return;
+    TString fname = diskName(key);
+    TString tmp = fname + TString::Format(".part%d_%u", gSystem->GetPid(), nwrites_++);
+    std::ofstream out(tmp.Data(), std::ios::binary);
+    uint32_t n = yields.size();
+    out.write(reinterpret_cast<const char*>(&n), sizeof(n));
+    for (const auto &q : yields){
+      out.write(reinterpret_cast<const char*>(&q.value), sizeof(q.value));
+      out.write(reinterpret_cast<const char*>(&q.error), sizeof(q.error));
+    }
+    out.close();
+    gSystem->Rename(tmp, fname);
+  }
+
+protected:
+  YieldCache() {}
+
+  TString diskName(const std::string &key) const {
+    return cachedir_ + "/" + key.c_str() + ".yld";
+  }
+
+  std::mutex mutex_;
+  map<std::string, vector<Quantity>> memory_;
+  TString cachedir_;
+  bool active_ = true;
+  std::atomic<unsigned> nwrites_{0};
+
+};
+
+}
+#endif /*ESTTOOLS_YIELDCACHE_HH_*/
@@ -0,0 +1,149 @@
+#ifndef ESTTOOLS_YIELDSNAPSHOT_HH_
+#define ESTTOOLS_YIELDSNAPSHOT_HH_
+
+#if !defined(__CINT__) || defined(__MAKECINT__)
+#include <iostream>
+#include <fstream>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <map>
+#include "TString.h"
+
+#include "Quantity.h"
+
+using namespace std;
+#endif
+
+namespace EstTools{
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+struct YieldSnapshot{
+  // binary snapshot of the estimator state (yields, std_yields, binMap, binlist), tagged with the config hash
+  // layout: magic, version, hash, then each container as [count][entries...]; strings as [length][bytes],
+  // numbers in native byte order (snapshots are a cache for the machine that wrote them, not an exchange format)
+
+  std::string hash;
+  map<TString, vector<Quantity>> yields;
+  map<std::string, map<std::string, vector<double>>> std_yields;
+  map<std::string, std::string> binMap;
+  vector<std::string> binlist;
+
+  void save(const std::string &filename) const {
+    std::string tmp = filename + ".part";
+    std::ofstream out(tmp, std::ios::binary);
+    if (!out.good()) throw std::invalid_argument("YieldSnapshot: cannot write " + filename);
+    out.write(MAGIC, sizeof(MAGIC));
+    writeNumber<uint32_t>(out, VERSION);
+    writeString(out, hash);
+
+    writeNumber<uint32_t>(out, yields.size());
+    for (const auto &y : yields){
+      writeString(out, y.first.Data());
+      writeNumber<uint32_t>(out, y.second.size());
+      for (const auto &q : y.second){
+        writeNumber<double>(out, q.value);
+        writeNumber<double>(out, q.error);
+      }
+    }
+
+    writeNumber<uint32_t>(out, std_yields.size());
+    for (const auto &proc : std_yields){
+      writeString(out, proc.first);
+      writeNumber<uint32_t>(out, proc.second.size());
+      for (const auto &bin : proc.second){
+        writeString(out, bin.first);
+        writeNumber<uint32_t>(out, bin.second.size());
+        for (auto v : bin.second) writeNumber<double>(out, v);
+      }
+    }
+
+    writeNumber<uint32_t>(out, binMap.size());
+    for (const auto &b : binMap){
+      writeString(out, b.first);
+      writeString(out, b.second);
+    }
+
+    writeNumber<uint32_t>(out, binlist.size());
+    for (const auto &b : binlist) writeString(out, b);
+
+    out.close();
+    if (std::rename(tmp.c_str(), filename.c_str()))
+      throw std::invalid_argument("YieldSnapshot: cannot write " + filename);
+  }
+
+  static YieldSnapshot load(const std::string &filename){
+    std::ifstream in(filename, std::ios::binary);
+    if (!in.good()) throw std::invalid_argument("YieldSnapshot: cannot read " + filename);
+    char magic[sizeof(MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in.good() || std::string(magic, sizeof(magic)) != std::string(MAGIC, sizeof(MAGIC)) || readNumber<uint32_t>(in) != VERSION)
+      throw std::invalid_argument("YieldSnapshot: " + filename + " is not a yield snapshot (or from another version)");
+
+    YieldSnapshot s;
+    s.hash = readString(in);
+
+    for (uint32_t n = readNumber<uint32_t>(in); n>0; --n){
+      TString name = readString(in).c_str();
+      auto &vec = s.yields[name];
+      vec.resize(readNumber<uint32_t>(in));
+      for (auto &q : vec){
+        q.value = readNumber<double>(in);
+        q.error = readNumber<double>(in);
+      }
+    }
+
+    for (uint32_t n = readNumber<uint32_t>(in); n>0; --n){
+      auto &proc = s.std_yields[readString(in)];
+      for (uint32_t nb = readNumber<uint32_t>(in); nb>0; --nb){
+        auto &vals = proc[readString(in)];
+        vals.resize(readNumber<uint32_t>(in));
+        for (auto &v : vals) v = readNumber<double>(in);
+      }
+    }
+
+    for (uint32_t n = readNumber<uint32_t>(in); n>0; --n){
+      auto key = readString(in);
+      s.binMap[key] = readString(in);
+    }
+
+    for (uint32_t n = readNumber<uint32_t>(in); n>0; --n) s.binlist.push_back(readString(in));
+
+    if (!in.good()) throw std::invalid_argument("YieldSnapshot: " + filename + " is truncated");
+    return s;
+  }
+
+private:
+  static constexpr char MAGIC[8] = {'E', 'S', 'T', 'Y', 'L', 'D', 'S', '\0'};
+  static constexpr uint32_t VERSION = 1;
+
+  template<typename T>
+  static void writeNumber(std::ofstream &out, T v){ out.write(reinterpret_cast<const char*>(&v), sizeof(v)); }
+
+  template<typename T>
+  static T readNumber(std::ifstream &in){
+    T v = 0;
+    in.read(reinterpret_cast<char*>(&v), sizeof(v));
+    if (!in.good()) throw std::invalid_argument("YieldSnapshot: unexpected end of file");
+    return v;
+  }
+
+  static void writeString(std::ofstream &out, const std::string &str){
+    writeNumber<uint32_t>(out, str.size());
+    out.write(str.data(), str.size());
+  }
+
+  static std::string readString(std::ifstream &in){
+    std::string str(readNumber<uint32_t>(in), '\0');
+    in.read(&str[0], str.size());
+    return str;
+  }
+
+};
+
+constexpr char YieldSnapshot::MAGIC[8];
+constexpr uint32_t YieldSnapshot::VERSION;
+
+}
+#endif /*ESTTOOLS_YIELDSNAPSHOT_HH_*/